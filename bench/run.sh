@@ -0,0 +1,25 @@
+#!/bin/sh
+# Replays bench/edit.keys against generated corpora of different sizes and
+# line lengths: sh bench/run.sh [mtte binary]
+set -e
+bin=${1:-./mtte}
+dir=${TMPDIR:-/tmp}/mtte-bench
+mkdir -p "$dir"
+
+# gen NAME LINES WIDTH
+gen() {
+	awk -v n="$2" -v w="$3" 'BEGIN {
+		while(length(pad) < w) pad = pad "abc \"def\" 42 ";
+		pad = substr(pad, 1, w);
+		for(i = 0; i < n; ++i) printf "int f%d(void) { /* c */ return %d; } // %s\n", i, i, pad;
+	}' > "$dir/$1.c"
+}
+
+gen small 2000 20
+gen large 1000000 40
+gen long 2000 4000
+
+for corpus in small large long; do
+	"$bin" --replay bench/edit.keys "$dir/$corpus.c"
+	echo
+done
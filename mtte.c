@@ -11,17 +11,51 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* macros */
 
 #define VERSION "0.1"
 #define TAB_SIZE 2
 #define QUIT_TIMES 3
+#define STATUS_TIMEOUT 5
+#define ESC_TIMEOUT 100
+#define ROW_LEAF_MAX 64
+#define ROW_NODE_MAX 32
+#define ROW_CHUNK 4096
+#define INDEX_CHUNK_MIN (1 << 22)
+#define INDEX_THREADS_MAX 64
+#define INPUT_RING_SIZE (1 << 16)
+#define SAVE_IOV_MAX 1024
+#define SEARCH_BATCH_LEAVES 256
+#define SLAB_SIZE (1 << 16)
+#define SLAB_MAX 8192
+#define SLAB_CLASSES 37
+#define REGEX_REPEAT_MAX 255
+#define REGEX_DEPTH_MAX 64
+#define REGEX_NFA_MAX (1 << 16)
+#define REGEX_LITERAL_MAX 64
+#define DFA_STATES_MAX 1024
+#define DFA_TABLE_SIZE 4096
+#define REPLAY_ROWS 24
+#define REPLAY_COLS 80
+#define STATS_WINDOW 1024
+#define PAGE_BUDGET_MB 256
+#define STATS_BUCKETS 252
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -35,7 +69,9 @@ enum editorKey {
 	HOME_KEY,
 	END_KEY,
 	PAGE_UP,
-	PAGE_DOWN
+	PAGE_DOWN,
+	PASTE_START,
+	PASTE_END
 };
 
 enum editorHighlight {
@@ -52,8 +88,29 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define STYLE_DEFAULT 39
+#define STYLE_INVERSE 0x80
+
+#define ROW_MAPPED (1<<0)
+#define ROW_HL_STALE (1<<1)
+#define ROW_RENDER_ALIAS (1<<2)
+#define ROW_ASCII (1<<3)
+
+#define UTF8_BAD 0x110000
+#define CELL_CLUSTER 0x80000000u
+
 /* data */
 
+/* Collision-free hash of a syntax's keywords, filled in by editorSyntaxCompile */
+struct keywordTable {
+	unsigned int seed;
+	unsigned int mask;
+	int maxLen;
+	char** words;
+	int* lens;
+	unsigned char* types;
+};
+
 struct editorSyntax {
 	char* filetype;
 	char** filematch;
@@ -62,32 +119,315 @@ struct editorSyntax {
 	char* multiLineCommentStart;
 	char* multiLineCommentEnd;
 	int flags;
+	struct keywordTable keywordTable;
+	int delimMax;
+};
+
+/* Render columns [start, start + len) that share one highlight class */
+struct hlSpan {
+	long start;
+	long len;
+	unsigned char hl;
+};
+
+/* What the lexer carries from one column to the next, taken at column `at` */
+struct lexState {
+	long at;
+	int inComment;
+	int inString;
+	int prevSep;
+	int lineComment;
+	unsigned char prevHl;
+};
+
+/* Rows longer than ROW_CHUNK chars are split into chunks that start every
+ * ROW_CHUNK chars, or near it once edits move them, on a whole code point.
+ * Each keeps where it starts in chars, render and display columns and the
+ * lexer state there, so cursor mapping and re-lexing can start from the
+ * nearest chunk instead of column 0 */
+struct rowChunk {
+	long cx;
+	long rx;
+	long col;
+	struct lexState lex;
 };
 
 typedef struct erow {
-	int idx;
-	int size;
-	int rsize;
+	struct rowNode* leaf;
+	long size;
+	long rsize;
 	char* chars;
 	char* render;
-	unsigned char* hl;
+	struct hlSpan* spans;
+	struct rowChunk* chunks;
+	long numSpans;
+	long numChunks;
+	long charsCap;
+	long renderCap;
+	long spansCap;
+	long chunksCap;
+	int hlInComment;
 	int hlOpenComment;
+	int flags;
+	unsigned int gen;
 } erow;
 
+/* B+tree of rows: leaves hold the rows, inner nodes their subtree line counts.
+ * A mapped leaf has no rows yet: its lines are read from the file mapping at
+ * mapOff. Leaves loaded from the mapping sit in the page ring at pageSlot,
+ * and go back to being mapped when evicted. hlFn holds the comment state a
+ * leaf's lines end in when they start outside a comment (bit 0) and inside
+ * one (bit 1), or -1 until the highlighting worker has lexed them */
+typedef struct rowNode {
+	struct rowNode* parent;
+	int isLeaf;
+	int count;
+	long numRows;
+	size_t mapOff;
+	int mapped;
+	int pageSlot;
+	int referenced;
+	int hlIn;
+	int hlFn;
+	long hlTask;
+	erow* rows;
+	struct rowNode** children;
+} rowNode;
+
+/* Leaves loaded from the file mapping, swept by a clock hand whenever row
+ * memory is over budget */
+struct pageRing {
+	rowNode** leaves;
+	int count;
+	int cap;
+	int hand;
+	size_t budget;
+	size_t evicted;
+};
+
+/* One frame of cells, kept as separate planes so runs can be copied whole.
+ * A cell holds a code point, or 0 right of a wide one; a glyph with
+ * combining marks holds CELL_CLUSTER plus where its UTF-8 starts in extra,
+ * after a length byte */
+struct screen {
+	unsigned int* chars;
+	unsigned char* styles;
+	char* extra;
+	int extraLen;
+	int extraCap;
+};
+
+/* Output for one refresh; keeps its capacity from frame to frame */
+struct frameArena {
+	char* b;
+	int len;
+	int cap;
+};
+
+enum rowMemKind {
+	MEM_CHARS = 0,
+	MEM_RENDER,
+	MEM_HL,
+	MEM_ROWS,
+	MEM_KINDS
+};
+
+/* Row buffers up to SLAB_MAX bytes come from size classes, four to each
+ * power of two rounded up to 8 bytes so spans stay aligned, carved out of
+ * slabs and recycled through a free list per class. Bytes in use are
+ * counted per kind of buffer */
+struct rowMemory {
+	int classSize[SLAB_CLASSES];
+	void* freeList[SLAB_CLASSES];
+	unsigned char classOf[SLAB_MAX / 4 + 1];
+	char* slab;
+	size_t slabLeft;
+	size_t slabBytes;
+	size_t slabUsed;
+	size_t used[MEM_KINDS];
+};
+
+enum statKind {
+	STAT_DECODE = 0,
+	STAT_EDIT,
+	STAT_SYNTAX,
+	STAT_DRAW,
+	STAT_WRITE,
+	STAT_LATENCY,
+	STAT_BYTES,
+	STAT_RELEXED,
+	STAT_ALLOCS,
+	STAT_KINDS
+};
+
+/* Samples bucketed on a log scale, four buckets to each power of two. Every
+ * sample counts towards total; only the last STATS_WINDOW towards recent */
+struct statHist {
+	unsigned char window[STATS_WINDOW];
+	unsigned long long recent[STATS_BUCKETS];
+	unsigned long long total[STATS_BUCKETS];
+	unsigned long long count;
+	unsigned long long sum;
+	long long max;
+};
+
+/* Phase timings in ns and per-frame counters. Lexing, allocations and the
+ * time input arrived are accumulated until the frame they lead to is shown */
+struct editorStats {
+	struct statHist hist[STAT_KINDS];
+	long long inputAt;
+	long long syntaxNs;
+	long long relexed;
+	long long allocs;
+	int prompted;
+	int overlay;
+	char* file;
+};
+
+/* One line of a replay script: keys fed `repeat` times, each run timed */
+struct replayOp {
+	char* name;
+	char* keys;
+	int len;
+	int repeat;
+	long long* samples;
+	size_t outBytes;
+};
+
+/* Bytes read from the terminal but not decoded into keys yet */
+struct inputRing {
+	char buf[INPUT_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+};
+
+/* A save in progress: the text of every row as of Ctrl-S, written out by a
+ * worker thread while editing goes on */
+struct saveJob {
+	pthread_t thread;
+	int threaded;
+	unsigned int gen;
+	int dirty;
+	mode_t umask;
+	char* filename;
+	struct iovec* iov;
+	size_t numIov;
+	size_t capIov;
+	char** orphans;
+	long* orphanCaps;
+	size_t numOrphans;
+	size_t capOrphans;
+	size_t written;
+	int error;
+	int syncError;
+};
+
+struct searchMatch {
+	long row;
+	long col;
+	long len;
+};
+
+/* A run of leaves scanned by one worker at a time */
+struct searchBatch {
+	struct rowNode** leaves;
+	int numLeaves;
+	long firstRow;
+	struct searchMatch* matches;
+	size_t numMatches;
+	size_t cap;
+	int done;
+};
+
+/* The query being typed at the find prompt and every match of it, in order.
+ * While a scan runs, batches finish in any order and are merged into the
+ * index as soon as all batches before them are done */
+struct searchState {
+	char* query;
+	int len;
+	int regex;
+	struct regex* re;
+	struct searchMatch* matches;
+	size_t numMatches;
+	size_t cap;
+	size_t current;
+	int shown;
+	long hlRow;
+	long hlFrom;
+	long hlTo;
+	struct rowNode** leaves;
+	struct searchBatch* batches;
+	int numBatches;
+	int merged;
+	int nextBatch;
+	int cancel;
+	pthread_t threads[INDEX_THREADS_MAX];
+	int numThreads;
+};
+
+/* A mapped leaf to lex, with where its lines are in the mapping, which does
+ * not change under the worker. The worker only writes fn; the editor clears
+ * leaf once the leaf's lines change or it is freed */
+struct hlTask {
+	rowNode* leaf;
+	size_t mapOff;
+	int count;
+	int fn;
+};
+
+/* Mapped leaves lexed by a worker thread in order, each task published by
+ * advancing done, so catching up to a row far down the file can step over
+ * leaves rather than load and lex them */
+struct hlJob {
+	pthread_t thread;
+	int running;
+	struct hlTask* tasks;
+	long numTasks;
+	long done;
+	long merged;
+	int cancel;
+	int pending;
+};
+
 struct editorConfig {
-	int cx, cy;
-	int rx;
+	long cx, cy;
+	long rx;
 	int scrRows;
 	int scrCols;
-	int numRows;
-	int rowOff;
-	int colOff;
-	erow* row;
+	long numRows;
+	long rowOff;
+	long colOff;
+	rowNode* rowRoot;
 	int dirty;
 	char* filename;
 	char statusmsg[80];
 	time_t statusmsg_time;
+	struct screen frame;
+	struct screen shown;
+	struct frameArena out;
+	struct inputRing in;
+	int winchPipe[2];
+	struct saveJob* save;
+	struct searchState search;
+	int searchWake[2];
+	unsigned int saveGen;
+	int saveDone[2];
+	int frameRows;
+	int frameCols;
+	int frameValid;
+	long shownRowOff;
+	long shownColOff;
 	struct editorSyntax* syntax;
+	long hlStaleFrom;
+	long hlStaleTo;
+	struct hlJob hlJob;
+	char* map;
+	size_t mapLen;
+	struct pageRing pages;
+	struct rowMemory mem;
+	int headless;
+	size_t sinkBytes;
+	struct editorStats stats;
 	struct termios orig_termios;	
 };
 
@@ -95,7 +435,7 @@ struct editorConfig E;
 
 /* File Types */
 
-char* C_HL_extensions[] = {".c", ".h", ".cpp"};
+char* C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
 char* C_HL_keywords[] = {
 	"switch", "if", "while", "for", "break", "continue", "return", "else",
  	"struct", "union", "typedef", "static", "enum", "class", "case", "const",
@@ -119,9 +459,106 @@ struct editorSyntax HLDB[] = {
 /* Prototypes */
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorSaveFinish();
+void editorFindProgress();
+void editorRowRender(erow* row);
+void editorRowFreeRender(erow* row);
+void editorUpdateSyntax(erow *row, int inComment);
+void pageAdd(rowNode* leaf);
+void pageRemove(rowNode* leaf);
 void editorRefreshScreen();
+void editorScroll();
+int getWindowSize(int* rows, int* cols);
 char* editorPrompt(char* prompt, void (*callback)(char *, int));
 
+/* Stats */
+
+const char* statNames[STAT_KINDS] = {
+	"decode_ns", "edit_ns", "syntax_ns", "draw_ns", "write_ns", "key_to_screen_ns",
+	"frame_bytes", "frame_relexed_rows", "frame_allocations"
+};
+
+/* Monotonic nanoseconds, for the stats and for timing --replay runs */
+long long statNow() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int statBucket(long long v) {
+	if(v < 4) return v < 0 ? 0 : (int)v;
+	int log = 63 - __builtin_clzll(v);
+	return 4 * (log - 1) + (int)((v >> (log - 2)) & 3);
+}
+
+/* Middle of the range of values a bucket holds */
+long long statBucketValue(int b) {
+	if(b < 4) return b;
+	int shift = b / 4 - 1;
+	return ((4LL + b % 4) << shift) + (1LL << shift) / 2;
+}
+
+void statAdd(int kind, long long v) {
+	struct statHist* h = &E.stats.hist[kind];
+	int b = statBucket(v);
+	int at = h->count % STATS_WINDOW;
+	if(h->count >= STATS_WINDOW) h->recent[h->window[at]]--;
+	h->window[at] = b;
+	h->recent[b]++;
+	h->total[b]++;
+	h->count++;
+	h->sum += v;
+	if(v > h->max) h->max = v;
+}
+
+/* The value below which a `pct` percent of n bucketed samples fall, to
+ * within the width of a bucket */
+long long statPercentile(const unsigned long long* counts, unsigned long long n, int pct) {
+	if(n == 0) return 0;
+	unsigned long long want = (n * pct + 99) / 100, seen = 0;
+	for(int b = 0; b < STATS_BUCKETS; ++b) {
+		seen += counts[b];
+		if(seen >= want) return statBucketValue(b);
+	}
+	return 0;
+}
+
+/* Writes "123us" or "4.5ms" */
+void statFormatNs(char* buf, size_t size, long long ns) {
+	if(ns < 1000000) snprintf(buf, size, "%lldus", ns / 1000);
+	else snprintf(buf, size, "%.1fms", ns / 1e6);
+}
+
+/* Closes the books on one frame and samples everything accumulated for it */
+void statFrame(int bytes) {
+	struct editorStats* st = &E.stats;
+	long long now = statNow();
+	if(st->inputAt) statAdd(STAT_LATENCY, now - st->inputAt);
+	statAdd(STAT_BYTES, bytes);
+	statAdd(STAT_SYNTAX, st->syntaxNs);
+	statAdd(STAT_RELEXED, st->relexed);
+	statAdd(STAT_ALLOCS, st->allocs);
+	st->inputAt = 0;
+	st->syntaxNs = 0;
+	st->relexed = 0;
+	st->allocs = 0;
+}
+
+/* Registered with atexit when --stats-file is given */
+void editorStatsWrite() {
+	FILE* fp = fopen(E.stats.file, "w");
+	if(!fp) return;
+	fprintf(fp, "{\n");
+	for(int k = 0; k < STAT_KINDS; ++k) {
+		struct statHist* h = &E.stats.hist[k];
+		fprintf(fp, "  \"%s\": {\"count\": %llu, \"sum\": %llu, \"p50\": %lld, \"p99\": %lld, \"max\": %lld}%s\n",
+			statNames[k], h->count, h->sum, statPercentile(h->total, h->count, 50),
+			statPercentile(h->total, h->count, 99), h->max, k + 1 < STAT_KINDS ? "," : "");
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+}
+
 /* Tcerminal */
 
 void die(const char *s) {
@@ -132,6 +569,7 @@ void die(const char *s) {
 }
 
 void exitRawMode() {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
 	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetatt");
 }
 
@@ -144,42 +582,132 @@ void enterRawMode() {
 	raw.c_oflag &= ~(OPOST);
 	raw.c_cflag |= (CS8);
 	raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+	// Reads never block; waiting for input is done with poll
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 	// passing back the attribute struct
 	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetatt");
+	// Bracketed paste, so a paste arrives as one block instead of keystrokes
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-/* Reads key input and translates escape sequences */
-int editorReadKey() {
-	int nread;
-	char c;
-	while((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if(nread == -1 && errno != EAGAIN) die("read");
+/* Reads as much pending input as fits into the ring; 0 if none arrived */
+int inputFill() {
+	struct inputRing* in = &E.in;
+	unsigned int used = in->tail - in->head;
+	if(used == INPUT_RING_SIZE) return 0;
+	unsigned int at = in->tail % INPUT_RING_SIZE;
+	unsigned int room = INPUT_RING_SIZE - at;
+	if(room > INPUT_RING_SIZE - used) room = INPUT_RING_SIZE - used;
+
+	int nread = read(STDIN_FILENO, &in->buf[at], room);
+	if(nread == -1 && errno != EAGAIN) die("read");
+	if(nread <= 0) return 0;
+	in->tail += nread;
+	if(E.stats.inputAt == 0) E.stats.inputAt = statNow();
+	return nread;
+}
+
+int inputPending() {
+	return E.in.tail != E.in.head;
+}
+
+/* Queues keys as if they had been read from the terminal; 0 if they don't fit */
+int inputFeed(const char* s, int len) {
+	struct inputRing* in = &E.in;
+	if(len > INPUT_RING_SIZE - (int)(in->tail - in->head)) return 0;
+	for(int i = 0; i < len; ++i) in->buf[in->tail++ % INPUT_RING_SIZE] = s[i];
+	if(E.stats.inputAt == 0) E.stats.inputAt = statNow();
+	return 1;
+}
+
+/* Resizes only write a byte to a pipe; the event loop does the re-layout */
+void handleWinch(int sig) {
+	(void)sig;
+	int savedErrno = errno;
+	write(E.winchPipe[1], "", 1);
+	errno = savedErrno;
+}
+
+void editorHandleResize() {
+	char drain[64];
+	while(read(E.winchPipe[0], drain, sizeof(drain)) > 0);
+	if(getWindowSize(&E.scrRows, &E.scrCols) == -1) die("getWindowSize");
+	E.scrRows -= 2;
+}
+
+/* Milliseconds until the status message expires, or -1 if none is shown */
+int editorStatusTimeout() {
+	if(E.statusmsg[0] == '\0' || time(NULL) - E.statusmsg_time >= STATUS_TIMEOUT) return -1;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long left = (long long)(E.statusmsg_time + STATUS_TIMEOUT - now.tv_sec) * 1000000000LL - now.tv_nsec;
+	return left <= 0 ? 0 : (int)((left + 999999) / 1000000);
+}
+
+/* Sleeps in poll until input arrives, the window is resized or `timeout` ms
+ * pass (-1 waits forever); returns 1 if input was buffered. A headless editor
+ * only gets input fed to it, so the terminal is left out */
+int inputWait(int timeout) {
+	struct pollfd fds[4] = {
+		{ E.headless ? -1 : STDIN_FILENO, POLLIN, 0 },
+		{ E.winchPipe[0], POLLIN, 0 },
+		{ E.saveDone[0], POLLIN, 0 },
+		{ E.searchWake[0], POLLIN, 0 }
+	};
+	// A signal interrupts poll before its byte can be seen; just poll again
+	while(poll(fds, 4, timeout) == -1) {
+		if(errno != EINTR) die("poll");
 	}
+	if(fds[1].revents & POLLIN) editorHandleResize();
+	if(fds[2].revents & POLLIN) editorSaveFinish();
+	if(fds[3].revents & POLLIN) editorFindProgress();
+	if(fds[0].revents) return inputFill() > 0;
+	return 0;
+}
+
+/* Next byte of input, or -1 when none arrives within the escape timeout */
+int inputByte() {
+	if(!inputPending() && (E.headless || !inputWait(ESC_TIMEOUT))) return -1;
+	return (unsigned char)E.in.buf[E.in.head++ % INPUT_RING_SIZE];
+}
+
+/* Next byte of input if it has already been read, without consuming it */
+int inputPeek() {
+	if(!inputPending()) return -1;
+	return (unsigned char)E.in.buf[E.in.head % INPUT_RING_SIZE];
+}
+
+/* Translates the next key's bytes, including escape sequences */
+int editorDecodeKey() {
+	int c = inputByte();
 
 	if(c == '\x1b') {
-		char seq[3];
-
-		if(read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if(read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-		if(seq[0] == '[') {
-			if(isdigit(seq[1])) {
-				if(read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';				
-				if(seq[2] == '~') {
-					switch(seq[1]) {
-						case '1': return HOME_KEY;
-						case '3': return DEL_KEY;
-						case '4': return END_KEY;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME_KEY;
-						case '8': return END_KEY;
+		int seq0 = inputByte();
+		if(seq0 == -1) return '\x1b';
+		int seq1 = inputByte();
+		if(seq1 == -1) return '\x1b';
+
+		if(seq0 == '[') {
+			if(isdigit(seq1)) {
+				int code = seq1 - '0';
+				int next;
+				while((next = inputByte()) != -1 && isdigit(next)) code = code * 10 + next - '0';
+				if(next == '~') {
+					switch(code) {
+						case 1: return HOME_KEY;
+						case 3: return DEL_KEY;
+						case 4: return END_KEY;
+						case 5: return PAGE_UP;
+						case 6: return PAGE_DOWN;
+						case 7: return HOME_KEY;
+						case 8: return END_KEY;
+						case 200: return PASTE_START;
+						case 201: return PASTE_END;
 					}
 				}
 			} else {
-				switch(seq[1]) {
+				switch(seq1) {
 					case 'A': return ARROW_UP;
 					case 'B': return ARROW_DOWN;
 					case 'C': return ARROW_RIGHT;
@@ -189,16 +717,65 @@ int editorReadKey() {
 					case 'P': return DEL_KEY;
 				}
 			}
-		} else if(seq[0] == 'O') {
-			switch(seq[1]) {
+		} else if(seq0 == 'O') {
+			switch(seq1) {
 				case 'H': return HOME_KEY;
 				case 'F': return END_KEY;
 			}
 		}
 		return '\x1b';
 	} else {
-		return c;
+		return (char)c;
+	}
+}
+
+/* Waits for key input and decodes it */
+int editorReadKey() {
+	// Idle here; a resize or an expiring status message redraws the screen.
+	// A replay that runs out of keys inside a prompt cancels it
+	while(!inputPending()) {
+		if(E.headless) return '\x1b';
+		if(!inputWait(editorStatusTimeout())) editorRefreshScreen();
+	}
+	long long start = statNow();
+	int key = editorDecodeKey();
+	statAdd(STAT_DECODE, statNow() - start);
+	return key;
+}
+
+/* Collects a bracketed paste up to its end marker */
+char* editorReadPaste(size_t* len) {
+	static const char end[] = "\x1b[201~";
+	size_t size = 4096;
+	char* text = malloc(size);
+	size_t n = 0;
+	size_t matched = 0;
+
+	while(matched < sizeof(end) - 1) {
+		int c = inputByte();
+		// A replay that runs out of keys ends the paste where it stopped
+		if(c == -1 && E.headless) break;
+		if(c == -1) continue;
+		if(c == end[matched]) {
+			matched++;
+			continue;
+		}
+		if(n + matched + 1 > size) {
+			size = size * 2 + matched;
+			text = realloc(text, size);
+		}
+		memcpy(&text[n], end, matched);
+		n += matched;
+		matched = c == end[0];
+		if(!matched) text[n++] = c;
+	}
+	if(matched < sizeof(end) - 1) {
+		if(n + matched > size) text = realloc(text, n + matched);
+		memcpy(&text[n], end, matched);
+		n += matched;
 	}
+	*len = n;
+	return text;
 }
 
 int getCursorPosition(int* rows, int* cols) {
@@ -208,7 +785,9 @@ int getCursorPosition(int* rows, int* cols) {
   	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   	while (i < sizeof(buf) - 1) {
-  	    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+  	    int c = inputByte();
+  	    if (c == -1) break;
+  	    buf[i] = c;
   	    if (buf[i] == 'R') break;
   	    i++;
   	}
@@ -232,444 +811,3190 @@ int getWindowSize(int* rows, int* cols) {
   	}
 }
 
-/* Syntax Highlighting */
-
-int isseparator(int c) {
-	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{};", c) != NULL;
+/* Row memory */
+
+void rowMemInit() {
+	struct rowMemory* m = &E.mem;
+	int c = 0;
+	m->classSize[c++] = 16;
+	for(int size = 16; size < SLAB_MAX; size *= 2)
+		for(int step = 1; step <= 4; ++step) m->classSize[c++] = (size + step * size / 4 + 7) & ~7;
+	c = 0;
+	for(int i = 0; i <= SLAB_MAX / 4; ++i) {
+		while(m->classSize[c] < i * 4) ++c;
+		m->classOf[i] = c;
+	}
+	memset(m->freeList, 0, sizeof(m->freeList));
+	m->slab = NULL;
+	m->slabLeft = 0;
+	m->slabBytes = 0;
+	m->slabUsed = 0;
+	memset(m->used, 0, sizeof(m->used));
 }
 
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
-
-	if(E.syntax == NULL) return;
-
-	char** keywords = E.syntax->keywords;
-
-	char *scs = E.syntax->singleLineCommentStart;
-	char* mcs = E.syntax->multiLineCommentStart;
-	char* mce = E.syntax->multiLineCommentEnd;
-	int scsLen = scs ? strlen(scs) : 0;
-	int mcsLen = mcs ? strlen(mcs) : 0;
-	int mceLen = mce ? strlen(mce) : 0;
+/* Returns a buffer of at least `size` bytes and stores its capacity in *cap */
+void* rowMemAlloc(int kind, size_t size, long* cap) {
+	struct rowMemory* m = &E.mem;
+	if(size > SLAB_MAX) {
+		E.stats.allocs++;
+		*cap = size;
+		m->used[kind] += size;
+		return malloc(size);
+	}
+	E.stats.allocs++;
+	int c = m->classOf[(size + 3) / 4];
+	*cap = m->classSize[c];
+	m->used[kind] += *cap;
+	m->slabUsed += *cap;
+
+	// Free blocks hold the next free block of their class; blocks are only
+	// 8-byte aligned, so the link is copied rather than dereferenced
+	void* p = m->freeList[c];
+	if(p) {
+		memcpy(&m->freeList[c], p, sizeof(void*));
+		return p;
+	}
+	// The tail of a slab too short for this class is left unused
+	if(m->slabLeft < (size_t)*cap) {
+		m->slab = malloc(SLAB_SIZE);
+		m->slabLeft = SLAB_SIZE;
+		m->slabBytes += SLAB_SIZE;
+	}
+	p = m->slab;
+	m->slab += *cap;
+	m->slabLeft -= *cap;
+	return p;
+}
 
-	int prevSep = 1;
-	int inString = 0;
-	int inComment = (row->idx > 0 && E.row[row->idx - 1]. hlOpenComment);
+void rowMemFree(int kind, void* p, long cap) {
+	if(p == NULL) return;
+	struct rowMemory* m = &E.mem;
+	m->used[kind] -= cap;
+	if(cap > SLAB_MAX) {
+		free(p);
+		return;
+	}
+	int c = m->classOf[(cap + 3) / 4];
+	m->slabUsed -= cap;
+	memcpy(p, &m->freeList[c], sizeof(void*));
+	m->freeList[c] = p;
+}
 
-	int i = 0;
-	while(i < row->rsize) {
-		char c = row->render[i];
-		unsigned char prevHl = i > 0 ? row->hl[i-1] : HL_NORMAL;
+/* Grows a buffer to hold `size` bytes, keeping its first `keep`. Capacity
+ * grows by at least half each time, so repeated appends are amortized */
+void* rowMemGrow(int kind, void* p, long* cap, size_t size, size_t keep) {
+	if(size <= (size_t)*cap) return p;
+	size_t want = *cap + *cap / 2;
+	if(want < size) want = size;
+	long newCap;
+	void* q = rowMemAlloc(kind, want, &newCap);
+	if(keep) memcpy(q, p, keep);
+	rowMemFree(kind, p, *cap);
+	*cap = newCap;
+	return q;
+}
 
-		if(scsLen && !inString && !inComment) {
-			if(!strncmp(&row->render[i], scs, scsLen)) {
-				memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-				break;
-			}
-		}
+size_t rowMemUsed() {
+	struct rowMemory* m = &E.mem;
+	return m->used[MEM_CHARS] + m->used[MEM_RENDER] + m->used[MEM_HL] + m->used[MEM_ROWS];
+}
 
-		if(mcsLen && mceLen && !inString) {
-			if(inComment) {
-				row->hl[i] = HL_MLCOMMENT;
-				if(!strncmp(&row->render[i], mce, mceLen)) {
-					memset(&row->hl[i], HL_MLCOMMENT, mceLen);
-					i += mceLen;
-					inComment = 0;
-					prevSep = 1;
-					continue;
-				} else {
-					++i;
-					continue;
-				}
-			} else if(!strncmp(&row->render[i], mcs, mcsLen)) {
-				memset(&row->hl[i], HL_MLCOMMENT, mcsLen);
-				i += mcsLen;
-				inComment = 1;
-				continue;
-			} 
-		} 
+/* Reports where memory goes, in KiB: row buffers by kind, row structs and
+ * tree nodes, slab space not handed out, and the leaves paged out so far */
+void editorShowMemory() {
+	struct rowMemory* m = &E.mem;
+	editorSetStatusMessage("KiB: text %zu render %zu hl %zu rows %zu slack %zu evicted %zu",
+		m->used[MEM_CHARS] >> 10, m->used[MEM_RENDER] >> 10, m->used[MEM_HL] >> 10,
+		m->used[MEM_ROWS] >> 10, (m->slabBytes - m->slabUsed) >> 10, E.pages.evicted);
+}
 
-		if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-			if(inString) {
-				row->hl[i] = HL_STRING;
-				if(c == '\\' && i + 1 < row->size) {
-					row->hl[i+1] = HL_STRING;
-					i += 2;
-					continue;
-				}
-				if(c == inString) inString = 0;
-				++i;
-				prevSep = 1;
-				continue;
-			} else {
-				if(c == '"' || c == '\'') {
-					inString = c;
-					row->hl[i++] = HL_STRING;
-					continue;
-				}
-			}
-		} 
+/* Row store */
+
+rowNode* rowNodeNew(int isLeaf) {
+	rowNode* node = malloc(sizeof(rowNode));
+	E.mem.used[MEM_ROWS] += sizeof(rowNode) + (isLeaf ? 0 : sizeof(rowNode*) * ROW_NODE_MAX);
+	node->parent = NULL;
+	node->isLeaf = isLeaf;
+	node->count = 0;
+	node->numRows = 0;
+	node->mapOff = 0;
+	node->mapped = 0;
+	node->pageSlot = -1;
+	node->referenced = 0;
+	node->hlIn = -1;
+	node->hlFn = -1;
+	node->hlTask = -1;
+	node->rows = NULL;
+	node->children = isLeaf ? NULL : malloc(sizeof(rowNode*) * ROW_NODE_MAX);
+	return node;
+}
 
-		if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if((isdigit(row->render[i]) && (prevSep || prevHl == HL_NUMBER))
-				|| (c == '.' && prevHl == HL_NUMBER)) {
-				row->hl[i++] = HL_NUMBER;
-				prevSep = 0;
-				continue;
-			} 
-		}
+/* The leaf's lines changed, so what was found lexing them no longer holds */
+void rowLeafForget(rowNode* leaf) {
+	if(leaf->hlTask != -1) E.hlJob.tasks[leaf->hlTask].leaf = NULL;
+	leaf->hlTask = -1;
+	leaf->hlFn = -1;
+}
 
-		if(prevSep) {
-			int j;
-			for(j = 0; keywords[j]; j++) {
-				int klen = strlen(keywords[j]);
-				int kw2 = keywords[j][klen-1] == '|'	;
-				if(kw2) klen--;
-
-				if(!strncmp(&row->render[i], keywords[j], klen) &&
-						isseparator(row->render[i + klen])) {
-					memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-					i += klen;
-					break;
-				}
-			}
-			if(keywords[j] != NULL) {
-				prevSep = 0;
-				continue;
-			}
-		}
+void rowNodeFree(rowNode* node) {
+	rowLeafForget(node);
+	E.mem.used[MEM_ROWS] -= sizeof(rowNode) + (node->isLeaf ? 0 : sizeof(rowNode*) * ROW_NODE_MAX);
+	if(node->rows) E.mem.used[MEM_ROWS] -= sizeof(erow) * ROW_LEAF_MAX;
+	if(node->pageSlot != -1) pageRemove(node);
+	free(node->rows);
+	free(node->children);
+	free(node);
+}
 
-		prevSep = isseparator(c);
-		++i;
+/* Fills lines[0..count] with the offsets of `count` lines of the mapping
+ * starting at `off`; the last entry is where the final one ends */
+void rowMapLines(size_t off, int count, size_t* lines) {
+	for(int i = 0; i < count; ++i) {
+		lines[i] = off;
+		const char* nl = memchr(&E.map[off], '\n', E.mapLen - off);
+		off = nl ? (size_t)(nl - E.map) + 1 : E.mapLen;
 	}
-
-	int changed = (row->hlOpenComment != inComment);
-	row->hlOpenComment = inComment;
-	if(changed && row->idx + 1 < E.numRows) editorUpdateSyntax(&E.row[row->idx + 1]);
+	lines[count] = off;
 }
 
-int editorSyntaxToColour(int hl) {
-	switch(hl) {
-		case HL_COMMENT:
-		case HL_MLCOMMENT: return 36;
-		case HL_KEYWORD1: return 33;
-		case HL_KEYWORD2: return 32;
-		case HL_NUMBER: return 31;
-		case HL_STRING: return 35;
-		case HL_MATCH: return 34;
-		default: return 37;
+/* Builds a leaf's rows on first touch, pointing them into the file mapping if
+ * it has one. A leaf paged out with its lexer state known is lexed again from
+ * that state, so rows below it need not be rechecked */
+void rowLeafLoad(rowNode* leaf) {
+	leaf->referenced = 1;
+	if(leaf->rows) return;
+	leaf->rows = malloc(sizeof(erow) * ROW_LEAF_MAX);
+	E.mem.used[MEM_ROWS] += sizeof(erow) * ROW_LEAF_MAX;
+	if(!leaf->mapped) return;
+
+	size_t lines[ROW_LEAF_MAX + 1];
+	rowMapLines(leaf->mapOff, leaf->count, lines);
+	for(int i = 0; i < leaf->count; ++i) {
+		size_t start = lines[i];
+		size_t end = lines[i + 1];
+		if(end > start && E.map[end-1] == '\n') end--;
+		while(end > start && E.map[end-1] == '\r') end--;
+
+		erow* row = &leaf->rows[i];
+		row->leaf = leaf;
+		row->size = end - start;
+		row->rsize = 0;
+		row->chars = &E.map[start];
+		row->render = NULL;
+		row->spans = NULL;
+		row->chunks = NULL;
+		row->numSpans = 0;
+		row->numChunks = 0;
+		row->charsCap = 0;
+		row->renderCap = 0;
+		row->spansCap = 0;
+		row->chunksCap = 0;
+		row->hlInComment = 0;
+		row->hlOpenComment = 0;
+		row->flags = ROW_MAPPED | ROW_HL_STALE;
+		row->gen = E.saveGen;
+	}
+	if(leaf->hlIn != -1) {
+		int inComment = leaf->hlIn;
+		for(int i = 0; i < leaf->count; ++i) {
+			editorUpdateSyntax(&leaf->rows[i], inComment);
+			inComment = leaf->rows[i].hlOpenComment;
+		}
+		leaf->hlIn = -1;
 	}
+	pageAdd(leaf);
+	// Search workers may be reading this leaf; publish the rows before the flag
+	__atomic_store_n(&leaf->mapped, 0, __ATOMIC_RELEASE);
 }
 
-void editorSelectSyntaxHighlight() {
-	E.syntax = NULL;
-	if(E.filename == NULL) return;
+int rowNodeChildIndex(rowNode* parent, rowNode* child) {
+	int i = 0;
+	while(parent->children[i] != child) ++i;
+	return i;
+}
 
-	char* ext = strrchr(E.filename, '.');
+void rowNodeAddRows(rowNode* node, long delta) {
+	for(; node; node = node->parent) node->numRows += delta;
+}
 
-	for(unsigned int j = 0; j < HLDB_ENTRIES; ++j) {
-		struct editorSyntax* s = &HLDB[j];
-		unsigned i = 0;
-		while(s->filematch[i]) {
-			int isExt = (s->filematch[i][0] == '.');
-			if((isExt && ext && !strcmp(ext, s->filematch[i])) || 
-					(!isExt && strstr(E.filename, s->filematch[i]))) {
-				E.syntax = s;
+/* Descends to the leaf holding row `at`; `at == numRows` lands past the last row */
+rowNode* rowStoreFind(long at, int* off) {
+	rowNode* node = E.rowRoot;
+	while(!node->isLeaf) {
+		int i;
+		for(i = 0; i < node->count - 1; ++i) {
+			if(at < node->children[i]->numRows) break;
+			at -= node->children[i]->numRows;
+		}
+		node = node->children[i];
+	}
+	rowLeafLoad(node);
+	*off = at;
+	return node;
+}
 
-				int filerow;
-				for(filerow = 0; filerow < E.numRows; ++filerow) editorUpdateSyntax(&E.row[filerow]);
+/* Moves the upper half of a full node into a new right sibling */
+void rowNodeSplit(rowNode* node) {
+	rowNode* parent = node->parent;
+	if(parent == NULL) {
+		parent = rowNodeNew(0);
+		parent->children[parent->count++] = node;
+		parent->numRows = node->numRows;
+		node->parent = parent;
+		E.rowRoot = parent;
+	} else if(parent->count == ROW_NODE_MAX) {
+		rowNodeSplit(parent);
+		parent = node->parent;
+	}
 
-				return;
-			}
-			++i;
+	rowNode* sibling = rowNodeNew(node->isLeaf);
+	if(node->isLeaf) {
+		rowLeafLoad(sibling);
+		rowLeafForget(node);
+	}
+	int half = node->count / 2;
+	sibling->count = node->count - half;
+	if(node->isLeaf) {
+		memcpy(sibling->rows, &node->rows[half], sizeof(erow) * sibling->count);
+		for(int i = 0; i < sibling->count; ++i) sibling->rows[i].leaf = sibling;
+		sibling->numRows = sibling->count;
+	} else {
+		memcpy(sibling->children, &node->children[half], sizeof(rowNode*) * sibling->count);
+		for(int i = 0; i < sibling->count; ++i) {
+			sibling->children[i]->parent = sibling;
+			sibling->numRows += sibling->children[i]->numRows;
 		}
 	}
+	node->count = half;
+	node->numRows -= sibling->numRows;
+	sibling->parent = parent;
+
+	int i = rowNodeChildIndex(parent, node);
+	memmove(&parent->children[i+2], &parent->children[i+1], sizeof(rowNode*) * (parent->count - i - 1));
+	parent->children[i+1] = sibling;
+	parent->count++;
 }
 
-/* Row operations */
+void rowNodeRemoveChild(rowNode* parent, int i) {
+	memmove(&parent->children[i], &parent->children[i+1], sizeof(rowNode*) * (parent->count - i - 1));
+	parent->count--;
+}
 
-int editorCxToRx(erow* row, int cx) {
-	int rx = 0;
-	for(int i = 0; i < cx; ++i) {
-		rx += (row->chars[i] == '\t') ? TAB_SIZE - rx % TAB_SIZE : 1;
+/* Drops empty nodes and merges underfull ones into a neighbour */
+void rowNodeRebalance(rowNode* node) {
+	rowNode* parent = node->parent;
+	if(parent == NULL) {
+		while(!E.rowRoot->isLeaf && E.rowRoot->count == 1) {
+			rowNode* old = E.rowRoot;
+			E.rowRoot = old->children[0];
+			E.rowRoot->parent = NULL;
+			rowNodeFree(old);
+		}
+		return;
 	}
-	return rx;
-}
 
-int editorRxToCx(erow* row, int rx) {
-	int curRx = 0;
-	int cx;
-	for(cx = 0; cx < row->size; ++cx) {
-		if(row->chars[cx] == '\t') curRx += (TAB_SIZE - 1) - (curRx % TAB_SIZE);
-		++curRx;
+	if(node->count == 0) {
+		rowNodeRemoveChild(parent, rowNodeChildIndex(parent, node));
+		rowNodeFree(node);
+		rowNodeRebalance(parent);
+		return;
+	}
 
-		if(curRx > rx) return cx;
+	int max = node->isLeaf ? ROW_LEAF_MAX : ROW_NODE_MAX;
+	if(node->count >= max / 4 || parent->count == 1) return;
+
+	int i = rowNodeChildIndex(parent, node);
+	if(i == 0) ++i;
+	rowNode* left = parent->children[i-1];
+	rowNode* right = parent->children[i];
+	if(left->count + right->count > max) return;
+
+	if(left->isLeaf) {
+		rowLeafLoad(left);
+		rowLeafLoad(right);
+		memcpy(&left->rows[left->count], right->rows, sizeof(erow) * right->count);
+		for(int j = 0; j < right->count; ++j) left->rows[left->count + j].leaf = left;
+		rowLeafForget(left);
+	} else {
+		memcpy(&left->children[left->count], right->children, sizeof(rowNode*) * right->count);
+		for(int j = 0; j < right->count; ++j) right->children[j]->parent = left;
 	}
-	return cx;
+	left->count += right->count;
+	left->numRows += right->numRows;
+	rowNodeRemoveChild(parent, i);
+	rowNodeFree(right);
+	rowNodeRebalance(parent);
 }
 
-void editorUpdateRow(erow* row) {
-	int tabs = 0;
-	for(int j = 0; j < row->size; ++j) {
-		if(row->chars[j] == '\t') ++tabs;
+/* Opens an uninitialised row slot at `at` */
+erow* rowStoreInsert(long at) {
+	int off;
+	rowNode* leaf = rowStoreFind(at, &off);
+	if(leaf->count == ROW_LEAF_MAX) {
+		rowNodeSplit(leaf);
+		if(off > leaf->count) {
+			off -= leaf->count;
+			leaf = leaf->parent->children[rowNodeChildIndex(leaf->parent, leaf) + 1];
+		}
 	}
 
+	memmove(&leaf->rows[off+1], &leaf->rows[off], sizeof(erow) * (leaf->count - off));
+	leaf->count++;
+	rowNodeAddRows(leaf, 1);
+	rowLeafForget(leaf);
+	leaf->rows[off].leaf = leaf;
+	return &leaf->rows[off];
+}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs*(TAB_SIZE-1) + 1);
+void rowStoreDelete(long at) {
+	int off;
+	rowNode* leaf = rowStoreFind(at, &off);
+	memmove(&leaf->rows[off], &leaf->rows[off+1], sizeof(erow) * (leaf->count - off - 1));
+	leaf->count--;
+	rowNodeAddRows(leaf, -1);
+	rowLeafForget(leaf);
+	rowNodeRebalance(leaf);
+}
 
-	int idx = 0;
-	for(int j = 0; j < row->size; ++j) {
-		if(row->chars[j] == '\t') {
-			do {
-				row->render[idx++] = ' ';
-			} while(idx % TAB_SIZE != 0);
-		} else
-			row->render[idx++] = row->chars[j];
+/* Replaces the tree with one built bottom-up over `count` ready-made leaves */
+void rowStoreBuild(rowNode** nodes, long count) {
+	while(count > 1) {
+		long parents = (count + ROW_NODE_MAX - 1) / ROW_NODE_MAX;
+		for(long i = 0; i < parents; ++i) {
+			rowNode* parent = rowNodeNew(0);
+			for(long j = i * ROW_NODE_MAX; j < count && parent->count < ROW_NODE_MAX; ++j) {
+				parent->children[parent->count++] = nodes[j];
+				parent->numRows += nodes[j]->numRows;
+				nodes[j]->parent = parent;
+			}
+			nodes[i] = parent;
+		}
+		count = parents;
 	}
-	row->render[idx] = '\0';
-	row->rsize = idx;
+	rowNodeFree(E.rowRoot);
+	E.rowRoot = nodes[0];
+}
 
-	editorUpdateSyntax(row);
+erow* editorRowAt(long at) {
+	if(at < 0 || at >= E.numRows) return NULL;
+	int off;
+	rowNode* leaf = rowStoreFind(at, &off);
+	return &leaf->rows[off];
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-	if(at < 0 || at > E.numRows) return;
+long editorRowIndex(erow* row) {
+	rowNode* node = row->leaf;
+	long at = row - node->rows;
+	for(; node->parent; node = node->parent) {
+		rowNode* parent = node->parent;
+		for(int i = 0; parent->children[i] != node; ++i) at += parent->children[i]->numRows;
+	}
+	return at;
+}
 
-	E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-	memmove(&E.row[at+1], &E.row[at], sizeof(erow) * (E.numRows - at));
-	for(int j = at + 1; j <= E.numRows; ++j) E.row[j].idx++;
+/* The leaf after this one, which may still be mapped */
+rowNode* rowLeafNext(rowNode* node) {
+	while(node->parent) {
+		rowNode* parent = node->parent;
+		int i = rowNodeChildIndex(parent, node);
+		if(i + 1 < parent->count) {
+			node = parent->children[i+1];
+			while(!node->isLeaf) node = node->children[0];
+			return node;
+		}
+		node = parent;
+	}
+	return NULL;
+}
 
-	E.row[at].idx = at;
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
-	E.numRows++;
-	E.dirty++;
+erow* editorRowNext(erow* row) {
+	rowNode* node = row->leaf;
+	int off = row - node->rows;
+	if(off + 1 < node->count) return row + 1;
 
-	E.row[at].rsize = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hlOpenComment = 0;
-	editorUpdateRow(&E.row[at]);
+	node = rowLeafNext(node);
+	if(node == NULL) return NULL;
+	rowLeafLoad(node);
+	return &node->rows[0];
 }
 
-void editorFreeRow(erow* row) {
-	free(row->chars);
-	free(row->render);
-	free(row->hl);
+erow* editorRowPrev(erow* row) {
+	rowNode* node = row->leaf;
+	if(row != node->rows) return row - 1;
+
+	while(node->parent) {
+		rowNode* parent = node->parent;
+		int i = rowNodeChildIndex(parent, node);
+		if(i > 0) {
+			node = parent->children[i-1];
+			while(!node->isLeaf) node = node->children[node->count - 1];
+			rowLeafLoad(node);
+			return &node->rows[node->count - 1];
+		}
+		node = parent;
+	}
+	return NULL;
 }
 
-void editorDeleteRow(int at) {
-	if(at < 0 || at > E.numRows) return;
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at+1], sizeof(erow) * (E.numRows - at - 1));
-	for(int j = at; j < E.numRows - 1; ++j) E.row[j].idx--;
+/* Paging */
+
+void pageAdd(rowNode* leaf) {
+	struct pageRing* r = &E.pages;
+	if(r->count == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 256;
+		r->leaves = realloc(r->leaves, sizeof(rowNode*) * r->cap);
+	}
+	leaf->pageSlot = r->count;
+	r->leaves[r->count++] = leaf;
+}
+
+/* The last leaf takes the slot, which only reorders the clock a little */
+void pageRemove(rowNode* leaf) {
+	struct pageRing* r = &E.pages;
+	rowNode* last = r->leaves[--r->count];
+	r->leaves[leaf->pageSlot] = last;
+	last->pageSlot = leaf->pageSlot;
+	leaf->pageSlot = -1;
+	if(r->hand >= r->count) r->hand = 0;
+}
+
+/* Whether a leaf's rows are still consecutive, unedited lines of the mapping,
+ * so they can be dropped and read again from it */
+int pageClean(rowNode* leaf) {
+	const char* end = E.map + E.mapLen;
+	const char* next = leaf->rows[0].chars;
+	if(next != E.map && next[-1] != '\n') return 0;
+	for(int i = 0; i < leaf->count; ++i) {
+		erow* row = &leaf->rows[i];
+		if(!(row->flags & ROW_MAPPED) || row->chars != next) return 0;
+		const char* p = row->chars + row->size;
+		while(p < end && *p == '\r') ++p;
+		if(p < end && *p != '\n') return 0;
+		next = p + 1;
+	}
+	return 1;
+}
+
+/* Drops a clean leaf's rows, keeping the lexer state it starts in when every
+ * row's is known, and lets the kernel reclaim the pages only it covered */
+void pageEvict(rowNode* leaf) {
+	int known = 1;
+	for(int i = 0; i < leaf->count; ++i) {
+		erow* row = &leaf->rows[i];
+		if(row->flags & ROW_HL_STALE) known = 0;
+		editorRowFreeRender(row);
+		rowMemFree(MEM_HL, row->spans, row->spansCap);
+	}
+	erow* last = &leaf->rows[leaf->count - 1];
+	size_t from = leaf->rows[0].chars - E.map;
+	size_t to = last->chars + last->size - E.map;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t pageFrom = (from + page - 1) / page * page;
+	size_t pageTo = to / page * page;
+	if(pageFrom < pageTo) madvise(E.map + pageFrom, pageTo - pageFrom, MADV_DONTNEED);
+
+	leaf->hlIn = known ? leaf->rows[0].hlInComment : -1;
+	if(leaf->hlFn == -1) E.hlJob.pending = 1;
+	leaf->mapOff = from;
+	free(leaf->rows);
+	E.mem.used[MEM_ROWS] -= sizeof(erow) * ROW_LEAF_MAX;
+	leaf->rows = NULL;
+	leaf->mapped = 1;
+	pageRemove(leaf);
+	E.pages.evicted++;
+}
+
+/* Sweeps the clock over the loaded leaves while row memory is over budget,
+ * visiting each at most once. Leaves touched since the hand last passed get
+ * another round; the rows on screen and the cursor's are touched first.
+ * Leaves are never paged out under a running scan, which reads them */
+void editorPageOut() {
+	struct pageRing* r = &E.pages;
+	if(rowMemUsed() <= r->budget || E.search.batches) return;
+
+	erow* row = editorRowAt(E.rowOff);
+	for(int y = 0; row && y < E.scrRows; ++y, row = editorRowNext(row)) row->leaf->referenced = 1;
+	if((row = editorRowAt(E.cy))) row->leaf->referenced = 1;
+
+	for(int steps = r->count; steps > 0 && r->count && rowMemUsed() > r->budget; --steps) {
+		rowNode* leaf = r->leaves[r->hand];
+		if(leaf->referenced) {
+			leaf->referenced = 0;
+		} else if(leaf->count && pageClean(leaf)) {
+			pageEvict(leaf);
+			continue;
+		}
+		r->hand = (r->hand + 1) % r->count;
+	}
+}
+
+/* UTF-8 */
+
+/* Each scanner returns the offset of the first byte at or after `i` that is
+ * not ASCII, or `len` */
+size_t asciiScanScalar(const char* s, size_t len, size_t i) {
+	while(i < len && !(s[i] & 0x80)) ++i;
+	return i;
+}
+
+#ifdef __SSE2__
+size_t asciiScanSSE2(const char* s, size_t len, size_t i) {
+	for(; i + 16 <= len; i += 16) {
+		unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(s + i)));
+		if(mask) return i + __builtin_ctz(mask);
+	}
+	return asciiScanScalar(s, len, i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t asciiScanAVX2(const char* s, size_t len, size_t i) {
+	for(; i + 32 <= len; i += 32) {
+		unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)(s + i)));
+		if(mask) return i + __builtin_ctz(mask);
+	}
+	return asciiScanScalar(s, len, i);
+}
+#endif
+
+size_t (*asciiScan)(const char*, size_t, size_t) = asciiScanScalar;
+
+/* Decodes the code point at s[i], returning its length in bytes. A byte that
+ * does not start a valid sequence, overlong forms and surrogates included,
+ * decodes alone as UTF8_BAD */
+int utf8Decode(const char* s, long len, long i, unsigned int* cp) {
+	unsigned char c = s[i];
+	int n = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+	*cp = c;
+	if(n == 1) return 1;
+	*cp = UTF8_BAD;
+	if(n == 0 || i + n > len) return 1;
+	unsigned int v = c & (0x7F >> n);
+	for(int k = 1; k < n; ++k) {
+		unsigned char cc = s[i + k];
+		if((cc & 0xC0) != 0x80) return 1;
+		v = v << 6 | (cc & 0x3F);
+	}
+	if((n == 3 && v < 0x800) || (n == 4 && (v < 0x10000 || v > 0x10FFFF)) || (v >= 0xD800 && v <= 0xDFFF)) return 1;
+	*cp = v;
+	return n;
+}
+
+int utf8Encode(unsigned int cp, char* out) {
+	if(cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if(cp < 0x800) {
+		out[0] = 0xC0 | cp >> 6;
+		out[1] = 0x80 | (cp & 0x3F);
+		return 2;
+	}
+	if(cp < 0x10000) {
+		out[0] = 0xE0 | cp >> 12;
+		out[1] = 0x80 | (cp >> 6 & 0x3F);
+		out[2] = 0x80 | (cp & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | cp >> 18;
+	out[1] = 0x80 | (cp >> 12 & 0x3F);
+	out[2] = 0x80 | (cp >> 6 & 0x3F);
+	out[3] = 0x80 | (cp & 0x3F);
+	return 4;
+}
+
+/* Start of the code point ending just before s[i]; a stray continuation
+ * byte is a code point of its own */
+long utf8Prev(const char* s, long i) {
+	long start = i - 1;
+	while(start > 0 && i - start < 4 && (s[start] & 0xC0) == 0x80) --start;
+	unsigned int cp;
+	if(utf8Decode(s, i, start, &cp) != i - start) return i - 1;
+	return start;
+}
+
+struct utf8Range {
+	unsigned int first;
+	unsigned int last;
+};
+
+/* Combining marks and other code points drawn over the one before them */
+const struct utf8Range utf8Zero[] = {
+	{0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+	{0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+	{0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+	{0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+	{0x07A6, 0x07B0}, {0x0900, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C},
+	{0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963},
+	{0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+	{0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+	{0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF},
+	{0xE0100, 0xE01EF}
+};
+
+/* East Asian wide and fullwidth forms and emoji, two columns each */
+const struct utf8Range utf8Wide[] = {
+	{0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+	{0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+	{0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+	{0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+	{0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+	{0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+	{0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+	{0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+	{0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+	{0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+	{0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+	{0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+	{0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+	{0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F64F},
+	{0x1F680, 0x1F6FF}, {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+	{0x30000, 0x3FFFD}
+};
+
+int utf8InRanges(const struct utf8Range* r, int n, unsigned int cp) {
+	int lo = 0, hi = n - 1;
+	while(lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if(cp < r[mid].first) hi = mid - 1;
+		else if(cp > r[mid].last) lo = mid + 1;
+		else return 1;
+	}
+	return 0;
+}
+
+/* Columns a code point takes on screen. Control characters and bytes that
+ * are not UTF-8 are drawn as one symbol */
+int utf8Width(unsigned int cp) {
+	if(cp < 0x300) return 1;
+	if(utf8InRanges(utf8Zero, sizeof(utf8Zero) / sizeof(utf8Zero[0]), cp)) return 0;
+	if(utf8InRanges(utf8Wide, sizeof(utf8Wide) / sizeof(utf8Wide[0]), cp)) return 2;
+	return 1;
+}
+
+/* Syntax Highlighting */
+
+unsigned char separators[256];
+
+int isseparator(int c) {
+	return separators[(unsigned char)c];
+}
+
+unsigned int keywordHash(unsigned int seed, const char* s, int len) {
+	unsigned int h = seed ^ 2166136261u;
+	for(int i = 0; i < len; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 16777619u;
+	}
+	return h ^ (h >> 16);
+}
+
+/* Gives every keyword its own slot, trying seeds and then doubling the table
+ * until nothing collides, so classifying an identifier takes a single probe */
+void editorCompileKeywords(struct editorSyntax* syntax) {
+	struct keywordTable* kt = &syntax->keywordTable;
+	int n = 0;
+	while(syntax->keywords[n]) ++n;
+
+	unsigned int size = 8;
+	while(size < 2u * n) size *= 2;
+	for(;;) {
+		kt->words = calloc(size, sizeof(char*));
+		kt->lens = calloc(size, sizeof(int));
+		kt->types = calloc(size, sizeof(unsigned char));
+		kt->mask = size - 1;
+		kt->maxLen = 0;
+
+		for(kt->seed = 1; kt->seed <= 256; ++kt->seed) {
+			int j;
+			memset(kt->words, 0, size * sizeof(char*));
+			for(j = 0; j < n; ++j) {
+				char* word = syntax->keywords[j];
+				int len = strlen(word);
+				int kw2 = word[len-1] == '|';
+				if(kw2) len--;
+
+				unsigned int slot = keywordHash(kt->seed, word, len) & kt->mask;
+				if(kt->words[slot]) break;
+				kt->words[slot] = word;
+				kt->lens[slot] = len;
+				kt->types[slot] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+				if(len > kt->maxLen) kt->maxLen = len;
+			}
+			if(j == n) return;
+		}
+
+		free(kt->words);
+		free(kt->lens);
+		free(kt->types);
+		size *= 2;
+	}
+}
+
+/* Returns the highlight class of the identifier s[0..len), or HL_NORMAL */
+int editorKeywordLookup(struct keywordTable* kt, const char* s, long len) {
+	if(len == 0 || len > kt->maxLen) return HL_NORMAL;
+	unsigned int slot = keywordHash(kt->seed, s, len) & kt->mask;
+	if(kt->words[slot] && kt->lens[slot] == len && !memcmp(kt->words[slot], s, len))
+		return kt->types[slot];
+	return HL_NORMAL;
+}
+
+void editorSyntaxCompile() {
+	for(int c = 0; c < 256; ++c)
+		separators[c] = isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{};", c) != NULL;
+	for(unsigned int j = 0; j < HLDB_ENTRIES; ++j) {
+		struct editorSyntax* s = &HLDB[j];
+		editorCompileKeywords(s);
+		char* delims[] = {s->singleLineCommentStart, s->multiLineCommentStart, s->multiLineCommentEnd};
+		s->delimMax = 0;
+		for(int i = 0; i < 3; ++i) {
+			if(delims[i] && (int)strlen(delims[i]) > s->delimMax) s->delimMax = strlen(delims[i]);
+		}
+	}
+}
+
+/* Stores the class of every render column as runs of equal classes */
+void editorRowSetSpans(erow* row, const unsigned char* hl, long len) {
+	long n = 0;
+	for(long i = 0; i < len; ++i) if(i == 0 || hl[i] != hl[i-1]) ++n;
+	if(row->spans == NULL || sizeof(struct hlSpan) * n > (size_t)row->spansCap) {
+		rowMemFree(MEM_HL, row->spans, row->spansCap);
+		row->spans = rowMemAlloc(MEM_HL, sizeof(struct hlSpan) * n, &row->spansCap);
+	}
+	n = 0;
+	for(long i = 0; i < len; ++n) {
+		long end = i + 1;
+		while(end < len && hl[end] == hl[i]) ++end;
+		row->spans[n].start = i;
+		row->spans[n].len = end - i;
+		row->spans[n].hl = hl[i];
+		i = end;
+	}
+	row->numSpans = n;
+}
+
+/* Scratch buffer the lexer classes render columns in, one byte each */
+unsigned char* editorLexScratch(long len) {
+	static unsigned char* hl = NULL;
+	static long hlSize = 0;
+	if(hl == NULL || len > hlSize) {
+		hl = realloc(hl, len + 1);
+		hlSize = len;
+	}
+	return hl;
+}
+
+int lexSame(const struct lexState* a, const struct lexState* b) {
+	return a->at == b->at && a->inComment == b->inComment && a->inString == b->inString
+		&& a->prevSep == b->prevSep && a->lineComment == b->lineComment && a->prevHl == b->prevHl;
+}
+
+/* Lexes text from the state in *st into hl, which is cleared just ahead of
+ * the lexer. Chunks from `next` on get the state the lexer reaches them in,
+ * unless a chunk at or past column `settle` already holds it: the rest of the
+ * row lexes as before, so lexing stops there. Returns the column it stopped
+ * at, or len, with the state left in *st */
+long editorLex(erow* row, const char* text, long len, unsigned char* hl, struct lexState* st, long next, long settle) {
+	struct keywordTable* keywords = &E.syntax->keywordTable;
+
+	char *scs = E.syntax->singleLineCommentStart;
+	char* mcs = E.syntax->multiLineCommentStart;
+	char* mce = E.syntax->multiLineCommentEnd;
+	int scsLen = scs ? strlen(scs) : 0;
+	int mcsLen = mcs ? strlen(mcs) : 0;
+	int mceLen = mce ? strlen(mce) : 0;
+
+	int inComment = st->inComment;
+	int inString = st->inString;
+	int prevSep = st->prevSep;
+	int lineComment = st->lineComment;
+
+	long i = st->at;
+	long cleared = i;
+	if(i > 0) hl[i-1] = st->prevHl;
+	while(i < len && !lineComment) {
+		for(; next < row->numChunks && row->chunks[next].rx <= i; ++next) {
+			struct lexState now = {i, inComment, inString, prevSep, 0, i > 0 ? hl[i-1] : HL_NORMAL};
+			if(settle >= 0 && i >= settle && lexSame(&row->chunks[next].lex, &now)) return i;
+			row->chunks[next].lex = now;
+		}
+		// Nothing writes further ahead than a keyword or comment delimiter
+		if(cleared - i < ROW_CHUNK / 2) {
+			long to = i + ROW_CHUNK < len ? i + ROW_CHUNK : len;
+			memset(&hl[cleared], HL_NORMAL, to - cleared);
+			cleared = to;
+		}
+
+		char c = text[i];
+		unsigned char prevHl = i > 0 ? hl[i-1] : HL_NORMAL;
+
+		if(scsLen && !inString && !inComment) {
+			if(i + scsLen <= len && !strncmp(&text[i], scs, scsLen)) {
+				lineComment = 1;
+				break;
+			}
+		}
+
+		if(mcsLen && mceLen && !inString) {
+			if(inComment) {
+				hl[i] = HL_MLCOMMENT;
+				if(i + mceLen <= len && !strncmp(&text[i], mce, mceLen)) {
+					memset(&hl[i], HL_MLCOMMENT, mceLen);
+					i += mceLen;
+					inComment = 0;
+					prevSep = 1;
+					continue;
+				} else {
+					++i;
+					continue;
+				}
+			} else if(i + mcsLen <= len && !strncmp(&text[i], mcs, mcsLen)) {
+				memset(&hl[i], HL_MLCOMMENT, mcsLen);
+				i += mcsLen;
+				inComment = 1;
+				continue;
+			} 
+		} 
+
+		if(E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+			if(inString) {
+				hl[i] = HL_STRING;
+				if(c == '\\' && i + 1 < len) {
+					hl[i+1] = HL_STRING;
+					i += 2;
+					continue;
+				}
+				if(c == inString) inString = 0;
+				++i;
+				prevSep = 1;
+				continue;
+			} else {
+				if(c == '"' || c == '\'') {
+					inString = c;
+					hl[i++] = HL_STRING;
+					continue;
+				}
+			}
+		} 
+
+		if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+			if((isdigit((unsigned char)c) && (prevSep || prevHl == HL_NUMBER))
+				|| (c == '.' && prevHl == HL_NUMBER)) {
+				hl[i++] = HL_NUMBER;
+				prevSep = 0;
+				continue;
+			} 
+		}
+
+		if(prevSep) {
+			long klen = 0;
+			while(i + klen < len && !isseparator(text[i + klen])) ++klen;
+			int type = editorKeywordLookup(keywords, &text[i], klen);
+			if(type != HL_NORMAL) {
+				memset(&hl[i], type, klen);
+				i += klen;
+				prevSep = 0;
+				continue;
+			}
+		}
+
+		prevSep = isseparator(c);
+		++i;
+	}
+
+	// A line comment runs to the end of the row, whatever follows
+	if(lineComment) {
+		memset(&hl[i], HL_COMMENT, len - i);
+		for(; next < row->numChunks; ++next) {
+			struct lexState now = {row->chunks[next].rx, 0, 0, 0, 1, HL_COMMENT};
+			if(settle >= 0 && now.at >= settle && lexSame(&row->chunks[next].lex, &now)) return now.at;
+			row->chunks[next].lex = now;
+		}
+	}
+	st->inComment = inComment;
+	return len;
+}
+
+/* Lexes `row` from the given multiline comment state and records the state it
+ * ends in. Columns are classed in a scratch buffer, which rendered rows then
+ * keep as spans; rows that are not rendered yet are lexed from chars, only to
+ * learn that end state */
+void editorUpdateSyntax(erow *row, int inComment) {
+	E.stats.relexed++;
+
+	char* text = row->render ? row->render : row->chars;
+	long len = row->render ? row->rsize : row->size;
+	unsigned char* hl = editorLexScratch(len);
+
+	row->hlInComment = inComment;
+	row->flags &= ~ROW_HL_STALE;
+	if(E.syntax == NULL) {
+		row->hlOpenComment = 0;
+		memset(hl, HL_NORMAL, len);
+		if(row->render) editorRowSetSpans(row, hl, len);
+		return;
+	}
+
+	struct lexState st = {0, inComment, 0, 1, 0, HL_NORMAL};
+	editorLex(row, text, len, hl, &st, 0, -1);
+	row->hlOpenComment = st.inComment;
+	if(row->render) editorRowSetSpans(row, hl, len);
+}
+
+/* Lexes the `count` lines of the mapping at mapOff from outside a comment and
+ * from inside one, and returns the state each ends in as bit 0 and bit 1.
+ * Once both reach the same state at the end of a line they go on as one.
+ * Uses no editor state besides the mapping, so the worker can call it */
+int hlLexMapped(size_t mapOff, int count, unsigned char** hl, long* cap) {
+	size_t lines[ROW_LEAF_MAX + 1];
+	rowMapLines(mapOff, count, lines);
+	erow none;
+	none.numChunks = 0;
+	int out[2] = {0, 1};
+	for(int i = 0; i < count; ++i) {
+		size_t start = lines[i];
+		size_t end = lines[i + 1];
+		if(end > start && E.map[end-1] == '\n') end--;
+		while(end > start && E.map[end-1] == '\r') end--;
+		long len = end - start;
+		if(*hl == NULL || len + 1 > *cap) {
+			*hl = realloc(*hl, len + 1);
+			*cap = len + 1;
+		}
+
+		int same = out[0] == out[1];
+		for(int j = 0; j < 2 - same; ++j) {
+			struct lexState st = {0, out[j], 0, 1, 0, HL_NORMAL};
+			editorLex(&none, &E.map[start], len, *hl, &st, 0, -1);
+			out[j] = st.inComment;
+		}
+		if(same) out[1] = out[0];
+	}
+	return out[0] | out[1] << 1;
+}
+
+void* hlWorker(void* arg) {
+	struct hlJob* job = arg;
+#ifdef SCHED_IDLE
+	// Lexing ahead only gets the time editing leaves over
+	struct sched_param idle = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &idle);
+#endif
+	unsigned char* hl = NULL;
+	long cap = 0;
+	for(long i = 0; i < job->numTasks && !__atomic_load_n(&job->cancel, __ATOMIC_RELAXED); ++i) {
+		struct hlTask* t = &job->tasks[i];
+		t->fn = hlLexMapped(t->mapOff, t->count, &hl, &cap);
+		__atomic_store_n(&job->done, i + 1, __ATOMIC_RELEASE);
+	}
+	free(hl);
+	return NULL;
+}
+
+/* Stops the worker, if one runs; leaves it has not got to are queued again */
+void hlCancel(struct hlJob* job) {
+	if(!job->running) return;
+	__atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+	pthread_join(job->thread, NULL);
+	for(long i = job->merged; i < job->numTasks; ++i) {
+		if(job->tasks[i].leaf) job->tasks[i].leaf->hlTask = -1;
+	}
+	if(job->merged < job->numTasks) job->pending = 1;
+	free(job->tasks);
+	job->tasks = NULL;
+	job->numTasks = 0;
+	job->running = 0;
+}
+
+/* Copies what the worker has published so far into the leaves still there,
+ * and reaps it once it is done */
+void hlMerge(struct hlJob* job) {
+	if(!job->running) return;
+	long done = __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+	for(; job->merged < done; ++job->merged) {
+		struct hlTask* t = &job->tasks[job->merged];
+		if(t->leaf == NULL) continue;
+		t->leaf->hlFn = t->fn;
+		t->leaf->hlTask = -1;
+	}
+	if(done == job->numTasks) hlCancel(job);
+}
+
+void hlCollect(struct hlJob* job, rowNode* node, long* cap) {
+	if(!node->isLeaf) {
+		for(int i = 0; i < node->count; ++i) hlCollect(job, node->children[i], cap);
+		return;
+	}
+	if(!node->mapped || node->hlFn != -1) return;
+	if(job->numTasks == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		job->tasks = realloc(job->tasks, sizeof(struct hlTask) * *cap);
+	}
+	struct hlTask* t = &job->tasks[job->numTasks];
+	t->leaf = node;
+	t->mapOff = node->mapOff;
+	t->count = node->count;
+	t->fn = -1;
+	node->hlTask = job->numTasks++;
+}
+
+/* Hands the mapped leaves not lexed yet to the worker. Called once a frame is
+ * out, so the first one never waits on it */
+void hlSchedule(struct hlJob* job) {
+	hlMerge(job);
+	if(job->running || !job->pending || E.syntax == NULL) return;
+	job->pending = 0;
+	long cap = 0;
+	hlCollect(job, E.rowRoot, &cap);
+	job->done = 0;
+	job->merged = 0;
+	job->cancel = 0;
+	if(job->numTasks) job->running = pthread_create(&job->thread, NULL, hlWorker, job) == 0;
+	if(job->running) return;
+	// Without a worker, leaves are lexed as catching up reaches them
+	for(long i = 0; i < job->numTasks; ++i) job->tasks[i].leaf->hlTask = -1;
+	free(job->tasks);
+	job->tasks = NULL;
+	job->numTasks = 0;
+}
+
+void hlForget(rowNode* node) {
+	if(node->isLeaf) node->hlFn = -1;
+	else for(int i = 0; i < node->count; ++i) hlForget(node->children[i]);
+}
+
+/* Widens the range of rows whose lexer state must be rechecked before display */
+void editorSyntaxInvalidate(long at) {
+	if(at < 0 || at >= E.numRows) return;
+	if(E.hlStaleFrom == -1 || at < E.hlStaleFrom) E.hlStaleFrom = at;
+	if(at > E.hlStaleTo) E.hlStaleTo = at;
+}
+
+/* Brings highlighting up to date through row `limit`. A row is re-lexed when
+ * it was edited or its start state no longer matches the row above; past the
+ * last invalidated row the first row that needs neither ends the walk. Leaves
+ * still mapped above the screen are stepped over whole by the state the
+ * worker found they end in, or lexed from the mapping if it has not yet.
+ * The walk is timed as a whole rather than row by row */
+void editorSyntaxCatchUp(long limit) {
+	static unsigned char* hl = NULL;
+	static long hlCap = 0;
+	if(E.hlStaleFrom == -1) return;
+	if(E.syntax == NULL) {
+		E.hlStaleFrom = E.hlStaleTo = -1;
+		return;
+	}
+
+	long long start = statNow();
+	hlMerge(&E.hlJob);
+	long at = E.hlStaleFrom;
+	erow* prev = editorRowAt(at - 1);
+	int inComment = prev ? prev->hlOpenComment : 0;
+	int off, settled = 0;
+	rowNode* leaf = rowStoreFind(at, &off);
+	while(leaf && at <= limit && !settled) {
+		// A walk that starts partway into a mapped leaf loads it instead, as
+		// hlIn and hlFn only describe the leaf from its first row
+		if(off == 0 && leaf->mapped && at + leaf->count <= E.rowOff) {
+			if(at > E.hlStaleTo && leaf->hlIn == inComment) {
+				settled = 1;
+				break;
+			}
+			if(leaf->hlFn == -1) leaf->hlFn = hlLexMapped(leaf->mapOff, leaf->count, &hl, &hlCap);
+			leaf->hlIn = inComment;
+			inComment = (leaf->hlFn >> inComment) & 1;
+			at += leaf->count;
+		} else {
+			rowLeafLoad(leaf);
+			for(; off < leaf->count && at <= limit; ++off, ++at) {
+				erow* row = &leaf->rows[off];
+				if(at >= E.rowOff) editorRowRender(row);
+				if((row->flags & ROW_HL_STALE) || row->hlInComment != inComment) {
+					editorUpdateSyntax(row, inComment);
+				} else if(at > E.hlStaleTo) {
+					settled = 1;
+					break;
+				}
+				inComment = row->hlOpenComment;
+			}
+		}
+		if(at <= limit && !settled) {
+			leaf = rowLeafNext(leaf);
+			off = 0;
+		}
+	}
+
+	if(settled || at >= E.numRows) E.hlStaleFrom = E.hlStaleTo = -1;
+	else E.hlStaleFrom = at;
+	E.stats.syntaxNs += statNow() - start;
+}
+
+int editorSyntaxToColour(int hl) {
+	switch(hl) {
+		case HL_COMMENT:
+		case HL_MLCOMMENT: return 36;
+		case HL_KEYWORD1: return 33;
+		case HL_KEYWORD2: return 32;
+		case HL_NUMBER: return 31;
+		case HL_STRING: return 35;
+		case HL_MATCH: return 34;
+		default: return 37;
+	}
+}
+
+void editorSelectSyntaxHighlight() {
+	// The worker lexes with the syntax in use
+	hlCancel(&E.hlJob);
+	E.syntax = NULL;
+	if(E.filename == NULL) return;
+
+	char* ext = strrchr(E.filename, '.');
+
+	for(unsigned int j = 0; j < HLDB_ENTRIES; ++j) {
+		struct editorSyntax* s = &HLDB[j];
+		unsigned i = 0;
+		while(s->filematch[i]) {
+			int isExt = (s->filematch[i][0] == '.');
+			if((isExt && ext && !strcmp(ext, s->filematch[i])) || 
+					(!isExt && strstr(E.filename, s->filematch[i]))) {
+				E.syntax = s;
+
+				// Rows are re-lexed when they are next displayed
+				for(erow* row = editorRowAt(0); row; row = editorRowNext(row))
+					row->flags |= ROW_HL_STALE;
+				hlForget(E.rowRoot);
+				E.hlJob.pending = 1;
+				editorSyntaxInvalidate(0);
+				editorSyntaxInvalidate(E.numRows - 1);
+
+				return;
+			}
+			++i;
+		}
+	}
+}
+
+/* Row operations */
+
+/* Last chunk starting at or before char `pos`, or display column `pos` */
+long editorRowChunkAt(erow* row, long pos, int byCol) {
+	long lo = 0, hi = row->numChunks - 1;
+	while(lo < hi) {
+		long mid = (lo + hi + 1) / 2;
+		if((byCol ? row->chunks[mid].col : row->chunks[mid].cx) <= pos) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+/* Index of the span covering render column rx, or numSpans past the last */
+long editorRowSpanAt(erow* row, long rx) {
+	long lo = 0, hi = row->numSpans;
+	while(lo < hi) {
+		long mid = (lo + hi) / 2;
+		if(row->spans[mid].start + row->spans[mid].len <= rx) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Columns the char at cx takes when it starts at column rx, and its length */
+int editorCharWidth(erow* row, long cx, long rx, int* len) {
+	unsigned int cp = (unsigned char)row->chars[cx];
+	*len = 1;
+	if(cp == '\t') return TAB_SIZE - rx % TAB_SIZE;
+	if(cp >= 0x80) *len = utf8Decode(row->chars, row->size, cx, &cp);
+	return utf8Width(cp);
+}
+
+/* Rows whose render aliases chars are ASCII without tabs, so columns map
+ * one to one */
+long editorCxToRx(erow* row, long cx) {
+	if((row->flags & ROW_RENDER_ALIAS) && (row->flags & ROW_ASCII)) return cx;
+	long rx = 0;
+	long i = 0;
+	if(row->numChunks) {
+		struct rowChunk* ch = &row->chunks[editorRowChunkAt(row, cx, 0)];
+		i = ch->cx;
+		rx = ch->col;
+	}
+	while(i < cx) {
+		int len;
+		rx += editorCharWidth(row, i, rx, &len);
+		i += len;
+	}
+	return rx;
+}
+
+long editorRxToCx(erow* row, long rx) {
+	if((row->flags & ROW_RENDER_ALIAS) && (row->flags & ROW_ASCII)) return rx < row->size ? rx : row->size;
+	long curRx = 0;
+	long cx = 0;
+	if(row->numChunks) {
+		struct rowChunk* ch = &row->chunks[editorRowChunkAt(row, rx, 1)];
+		cx = ch->cx;
+		curRx = ch->col;
+	}
+	while(cx < row->size) {
+		int len;
+		curRx += editorCharWidth(row, cx, curRx, &len);
+		if(curRx > rx) return cx;
+		cx += len;
+	}
+	return cx;
+}
+
+/* Moves cx one character forward or back, taking combining marks along
+ * with the character they follow */
+long editorRowStep(erow* row, long cx, int forward) {
+	if(row->render && (row->flags & ROW_ASCII)) return forward ? cx + 1 : cx - 1;
+	int len;
+	if(forward) {
+		editorCharWidth(row, cx, 0, &len);
+		cx += len;
+		while(cx < row->size && editorCharWidth(row, cx, 0, &len) == 0) cx += len;
+	} else {
+		do {
+			cx = utf8Prev(row->chars, cx);
+		} while(cx > 0 && editorCharWidth(row, cx, 0, &len) == 0);
+	}
+	return cx;
+}
+
+/* Lexes a row with the state above it now; rows below are rechecked lazily */
+void editorRowLex(erow* row) {
+	int wasStale = row->flags & ROW_HL_STALE;
+	int openComment = row->hlOpenComment;
+	erow* prev = editorRowPrev(row);
+	long long start = statNow();
+	editorUpdateSyntax(row, prev ? prev->hlOpenComment : 0);
+	E.stats.syntaxNs += statNow() - start;
+	if(wasStale || row->hlOpenComment != openComment) editorSyntaxInvalidate(editorRowIndex(row) + 1);
+}
+
+void editorRowFreeRender(erow* row) {
+	if(!(row->flags & ROW_RENDER_ALIAS)) rowMemFree(MEM_RENDER, row->render, row->renderCap);
+	row->render = NULL;
+	row->renderCap = 0;
+	row->flags &= ~(ROW_RENDER_ALIAS | ROW_ASCII);
+	rowMemFree(MEM_RENDER, row->chunks, row->chunksCap);
+	row->chunks = NULL;
+	row->numChunks = 0;
+	row->chunksCap = 0;
+}
+
+/* Splits a long row into chunks of ROW_CHUNK chars. Render columns are
+ * filled in here for rows without tabs and by editorUpdateRow otherwise;
+ * lexer states when the row is next lexed */
+void editorRowChunk(erow* row) {
+	long n = row->size > ROW_CHUNK ? (row->size + ROW_CHUNK - 1) / ROW_CHUNK : 0;
+	if(n == 0 || sizeof(struct rowChunk) * n > (size_t)row->chunksCap) {
+		rowMemFree(MEM_RENDER, row->chunks, row->chunksCap);
+		row->chunks = n ? rowMemAlloc(MEM_RENDER, sizeof(struct rowChunk) * n, &row->chunksCap) : NULL;
+		if(n == 0) row->chunksCap = 0;
+	}
+	row->numChunks = n;
+	for(long j = 0; j < n; ++j) {
+		row->chunks[j].cx = j * ROW_CHUNK;
+		row->chunks[j].rx = j * ROW_CHUNK;
+		row->chunks[j].col = j * ROW_CHUNK;
+	}
+}
+
+/* Lays out a row holding multibyte text by display column: tabs expand to the
+ * next column stop, and each chunk moves up to the first code point at or
+ * after its start. Render is only written when it is separate from chars */
+void editorRowMeasure(erow* row) {
+	int alias = row->flags & ROW_RENDER_ALIAS;
+	long idx = 0, col = 0, next = 0;
+	for(long j = 0; j < row->size; ) {
+		if(next < row->numChunks && j >= next * ROW_CHUNK) {
+			row->chunks[next].cx = j;
+			row->chunks[next].rx = idx;
+			row->chunks[next++].col = col;
+		}
+		int len;
+		int width = editorCharWidth(row, j, col, &len);
+		if(row->chars[j] == '\t') {
+			if(!alias) memset(&row->render[idx], ' ', width);
+			idx += width;
+		} else {
+			if(!alias) memcpy(&row->render[idx], &row->chars[j], len);
+			idx += len;
+		}
+		col += width;
+		j += len;
+	}
+	row->numChunks = next;
+	if(!alias) {
+		row->render[idx] = '\0';
+		row->rsize = idx;
+	}
+}
+
+/* Display width of chars [from, to) of a row without tabs, or -1 when `to`
+ * falls inside a code point */
+long editorRowWidth(erow* row, long from, long to) {
+	long col = 0;
+	while(from < to) {
+		int len;
+		col += editorCharWidth(row, from, 0, &len);
+		from += len;
+	}
+	return from == to ? col : -1;
+}
+
+/* Replaces the spans over render columns [from, to) with the runs in hl,
+ * where those columns held to - delta - from before an edit. Spans after
+ * move by delta, and runs meeting at either seam are joined */
+void editorRowSpliceSpans(erow* row, const unsigned char* hl, long from, long to, long delta) {
+	static struct hlSpan* mid = NULL;
+	static long midCap = 0;
+
+	long oldTo = to - delta;
+	long oldLen = row->rsize - delta;
+	long a = editorRowSpanAt(row, from);
+	long b = oldTo < oldLen ? editorRowSpanAt(row, oldTo) : row->numSpans;
+	struct hlSpan tail = {0, 0, HL_NORMAL};
+	if(b < row->numSpans) {
+		tail = row->spans[b];
+		tail.len = tail.start + tail.len - oldTo;
+		tail.start = to;
+	}
+
+	// The span the lexer restarted in keeps the part before `from`
+	long head = a;
+	if(a < row->numSpans && row->spans[a].start < from) {
+		row->spans[a].len = from - row->spans[a].start;
+		++head;
+	}
+
+	long m = 0;
+	for(long i = from; i < to; ++m) {
+		long end = i + 1;
+		while(end < to && hl[end] == hl[i]) ++end;
+		if(m == midCap) {
+			midCap = midCap ? midCap * 2 : 64;
+			mid = realloc(mid, sizeof(struct hlSpan) * midCap);
+		}
+		mid[m].start = i;
+		mid[m].len = end - i;
+		mid[m].hl = hl[i];
+		i = end;
+	}
+	long skip = 0;
+	if(m && head && row->spans[head-1].hl == mid[0].hl) {
+		row->spans[head-1].len += mid[0].len;
+		skip = 1;
+	}
+	int hasTail = b < row->numSpans && tail.len > 0;
+	struct hlSpan* last = m > skip ? &mid[m-1] : head ? &row->spans[head-1] : NULL;
+	if(hasTail && last && last->hl == tail.hl) {
+		last->len += tail.len;
+		hasTail = 0;
+	}
+
+	long rest = b < row->numSpans ? row->numSpans - b - 1 : 0;
+	long total = head + (m - skip) + hasTail + rest;
+	if(sizeof(struct hlSpan) * total > (size_t)row->spansCap)
+		row->spans = rowMemGrow(MEM_HL, row->spans, &row->spansCap, sizeof(struct hlSpan) * total,
+			sizeof(struct hlSpan) * row->numSpans);
+	struct hlSpan* out = &row->spans[head + (m - skip)];
+	if(rest) memmove(out + hasTail, &row->spans[b + 1], sizeof(struct hlSpan) * rest);
+	if(m > skip) memcpy(&row->spans[head], &mid[skip], sizeof(struct hlSpan) * (m - skip));
+	if(hasTail) *out = tail;
+	for(long i = 0; i < rest; ++i) out[hasTail + i].start += delta;
+	row->numSpans = total;
+}
+
+/* Catches a long row without tabs up with `delta` chars inserted at char
+ * `at`, or -delta removed there, without rebuilding it. Chunks after the
+ * edit move with their text, and lexing restarts from the last chunk before
+ * the word the edit touched, stopping at the first later chunk it reaches
+ * in the state it had before. Returns 0 when the row must be rebuilt */
+int editorRowEdit(erow* row, long at, long delta) {
+	if(row->numChunks == 0 || !(row->flags & ROW_RENDER_ALIAS) || (row->flags & ROW_HL_STALE)) return 0;
+	long k = editorRowChunkAt(row, at, 0);
+	long next = k + 1 < row->numChunks ? row->chunks[k+1].cx : row->size - delta;
+	long size = next + delta - row->chunks[k].cx;
+	if(size < 1 || size > 2 * ROW_CHUNK || at - delta > next) return 0;
+
+	// Multibyte text only gives its width by walking it, and an edit can join
+	// or split a code point across the start of the chunk, so the chunk
+	// before is walked too; chunks must still start on a code point
+	long colDelta = delta;
+	if(delta > 0 && asciiScan(row->chars, at + delta, at) != (size_t)(at + delta)) row->flags &= ~ROW_ASCII;
+	if(!(row->flags & ROW_ASCII)) {
+		long m = k > 0 ? k - 1 : k;
+		if(m < k && editorRowWidth(row, row->chunks[m].cx, row->chunks[k].cx) == -1) return 0;
+		long width = editorRowWidth(row, row->chunks[k].cx, next + delta);
+		if(width == -1) return 0;
+		if(k + 1 < row->numChunks) colDelta = row->chunks[k].col + width - row->chunks[k+1].col;
+	}
+
+	long long start = statNow();
+	E.stats.relexed++;
+	row->render = row->chars;
+	row->rsize = row->size;
+	for(long j = 0; j < row->numChunks; ++j) {
+		struct rowChunk* ch = &row->chunks[j];
+		if(j > k) {
+			ch->cx += delta;
+			ch->rx += delta;
+			ch->col += colDelta;
+		}
+		if(ch->lex.at > at) ch->lex.at += delta;
+	}
+
+	if(E.syntax == NULL) {
+		unsigned char normal = HL_NORMAL;
+		if(row->numSpans == 0) editorRowSetSpans(row, &normal, 1);
+		row->spans[0].len = row->rsize;
+		row->numSpans = row->rsize > 0;
+		E.stats.syntaxNs += statNow() - start;
+		return 1;
+	}
+
+	// Lexing looks ahead over identifiers, comment delimiters and two-byte
+	// escapes, so it has to restart that far before the word around the edit
+	long from = at;
+	while(from > 0 && !isseparator(row->render[from-1])) --from;
+	from -= E.syntax->delimMax > 2 ? E.syntax->delimMax : 2;
+	long c = k;
+	while(c > 0 && row->chunks[c].lex.at > from) --c;
+	struct lexState st = row->chunks[c].lex;
+	unsigned char* hl = editorLexScratch(row->rsize);
+	long settle = delta > 0 ? at + delta : at;
+	long to = editorLex(row, row->render, row->rsize, hl, &st, c + 1, settle);
+	editorRowSpliceSpans(row, hl, row->chunks[c].lex.at, to, delta);
+	if(to == row->rsize && st.inComment != row->hlOpenComment) {
+		row->hlOpenComment = st.inComment;
+		editorSyntaxInvalidate(editorRowIndex(row) + 1);
+	}
+	E.stats.syntaxNs += statNow() - start;
+	return 1;
+}
+
+void editorUpdateRow(erow* row) {
+	long tabs = 0;
+	const char* end = &row->chars[row->size];
+	for(const char* tab = row->chars; (tab = memchr(tab, '\t', end - tab)); ++tab) ++tabs;
+	int ascii = asciiScan(row->chars, row->size, 0) == (size_t)row->size;
+
+	// Without tabs render is the text itself; control characters are only
+	// substituted when drawn
+	if(tabs == 0) {
+		editorRowFreeRender(row);
+		row->render = row->chars;
+		row->rsize = row->size;
+		row->flags |= ROW_RENDER_ALIAS | (ascii ? ROW_ASCII : 0);
+		editorRowChunk(row);
+		if(!ascii) editorRowMeasure(row);
+		editorRowLex(row);
+		return;
+	}
+
+	if(row->flags & ROW_RENDER_ALIAS) editorRowFreeRender(row);
+	long need = row->size + tabs*(TAB_SIZE-1) + 1;
+	if(need > row->renderCap) {
+		rowMemFree(MEM_RENDER, row->render, row->renderCap);
+		row->render = rowMemAlloc(MEM_RENDER, need, &row->renderCap);
+	}
+
+	row->flags = ascii ? row->flags | ROW_ASCII : row->flags & ~ROW_ASCII;
+	editorRowChunk(row);
+	if(!ascii) {
+		editorRowMeasure(row);
+		editorRowLex(row);
+		return;
+	}
+	long idx = 0;
+	for(long j = 0; j < row->size; ++j) {
+		if(j % ROW_CHUNK == 0 && row->numChunks) row->chunks[j / ROW_CHUNK].rx = row->chunks[j / ROW_CHUNK].col = idx;
+		if(row->chars[j] == '\t') {
+			do {
+				row->render[idx++] = ' ';
+			} while(idx % TAB_SIZE != 0);
+		} else
+			row->render[idx++] = row->chars[j];
+	}
+	row->render[idx] = '\0';
+	row->rsize = idx;
+	editorRowLex(row);
+}
+
+/* Builds render and hl the first time a row backed by the file mapping is needed */
+void editorRowRender(erow* row) {
+	if(row->render == NULL) editorUpdateRow(row);
+}
+
+/* Whether a save in progress still has to write this row's heap text */
+int editorRowShared(erow* row) {
+	return E.save && !(row->flags & ROW_MAPPED) && row->gen <= E.save->gen;
+}
+
+/* Hands text the save in progress still reads over to it, to be freed once written */
+void editorSaveOrphan(erow* row) {
+	struct saveJob* job = E.save;
+	if(job->numOrphans == job->capOrphans) {
+		job->capOrphans = job->capOrphans ? job->capOrphans * 2 : 64;
+		job->orphans = realloc(job->orphans, sizeof(char*) * job->capOrphans);
+		job->orphanCaps = realloc(job->orphanCaps, sizeof(long) * job->capOrphans);
+	}
+	job->orphans[job->numOrphans] = row->chars;
+	job->orphanCaps[job->numOrphans++] = row->charsCap;
+}
+
+/* Releases a row's text, unless the mapping or a save in progress holds it */
+void editorRowFreeChars(erow* row) {
+	if(editorRowShared(row)) editorSaveOrphan(row);
+	else if(!(row->flags & ROW_MAPPED)) rowMemFree(MEM_CHARS, row->chars, row->charsCap);
+}
+
+/* Makes room for `size` bytes of text in a row that owns its text */
+void editorRowReserve(erow* row, long size) {
+	row->chars = rowMemGrow(MEM_CHARS, row->chars, &row->charsCap, size, row->size + 1);
+	if(row->flags & ROW_RENDER_ALIAS) row->render = row->chars;
+}
+
+/* Copies a row out of the file mapping, or away from a save in progress,
+ * before it is edited */
+void editorRowOwn(erow* row) {
+	if(!(row->flags & ROW_MAPPED) && !editorRowShared(row)) return;
+	long cap;
+	char* chars = rowMemAlloc(MEM_CHARS, row->size + 1, &cap);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	editorRowFreeChars(row);
+	row->chars = chars;
+	row->charsCap = cap;
+	row->flags &= ~ROW_MAPPED;
+	if(row->flags & ROW_RENDER_ALIAS) row->render = chars;
+	row->gen = E.saveGen;
+}
+
+/* Inserts a row without rendering it; it is rendered when first shown */
+erow* editorInsertRowLazy(long at, const char* s, size_t len) {
+	if(at < 0 || at > E.numRows) return NULL;
+
+	erow* row = rowStoreInsert(at);
+	if(E.hlStaleFrom >= at) E.hlStaleFrom++;
+	if(E.hlStaleTo >= at) E.hlStaleTo++;
+	row->size = len;
+	row->chars = rowMemAlloc(MEM_CHARS, len + 1, &row->charsCap);
+	memcpy(row->chars, s, len);
+	row->chars[len] = '\0';
+	E.numRows++;
+	E.dirty++;
+
+	row->rsize = 0;
+	row->render = NULL;
+	row->spans = NULL;
+	row->chunks = NULL;
+	row->numSpans = 0;
+	row->numChunks = 0;
+	row->renderCap = 0;
+	row->spansCap = 0;
+	row->chunksCap = 0;
+	row->hlInComment = 0;
+	row->hlOpenComment = 0;
+	row->flags = ROW_HL_STALE;
+	row->gen = E.saveGen;
+	editorSyntaxInvalidate(at);
+	return row;
+}
+
+void editorInsertRow(long at, char *s, size_t len) {
+	erow* row = editorInsertRowLazy(at, s, len);
+	if(row) editorUpdateRow(row);
+}
+
+void editorFreeRow(erow* row) {
+	editorRowFreeChars(row);
+	editorRowFreeRender(row);
+	rowMemFree(MEM_HL, row->spans, row->spansCap);
+}
+
+void editorDeleteRow(long at) {
+	if(at < 0 || at >= E.numRows) return;
+	editorFreeRow(editorRowAt(at));
+	rowStoreDelete(at);
 	E.numRows--;
+	if(E.hlStaleFrom > at) E.hlStaleFrom--;
+	if(E.hlStaleTo >= at) E.hlStaleTo--;
+	if(E.hlStaleTo < E.hlStaleFrom) E.hlStaleFrom = E.hlStaleTo = -1;
+	editorSyntaxInvalidate(at);
+	E.dirty++;
+}
+
+/* Swaps in new text from rowMemAlloc for row `at`, releasing the old text
+ * the way editorFreeRow does; it is rendered and re-lexed when next shown */
+void editorRowReplace(erow* row, long at, char* chars, long size, long cap) {
+	editorRowFreeChars(row);
+	row->chars = chars;
+	row->charsCap = cap;
+	row->size = size;
+	row->flags = (row->flags & ~ROW_MAPPED) | ROW_HL_STALE;
+	row->gen = E.saveGen;
+	editorRowFreeRender(row);
+	rowMemFree(MEM_HL, row->spans, row->spansCap);
+	row->spans = NULL;
+	row->numSpans = 0;
+	row->spansCap = 0;
+	row->rsize = 0;
+	editorSyntaxInvalidate(at);
 	E.dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, char c) {
-	if(at < 0 || at > row->size) at = row->size;
-	// extra char + null byte
-	row->chars = realloc(row->chars, row->size + 2);
-	memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
-	row->size++;
-	row->chars[at] = c;
-	editorUpdateRow(row);
-	E.dirty++;
+void editorRowInsertChar(erow *row, long at, char c) {
+	if(at < 0 || at > row->size) at = row->size;
+	editorRowOwn(row);
+	// extra char + null byte
+	editorRowReserve(row, row->size + 2);
+	memmove(&row->chars[at+1], &row->chars[at], row->size - at + 1);
+	row->size++;
+	row->chars[at] = c;
+	if(c == '\t' || !editorRowEdit(row, at, 1)) editorUpdateRow(row);
+	E.dirty++;
+}
+
+void editorInsertNewLine() {
+	if(E.cx == 0) {
+		editorInsertRow(E.cy, "", 0);
+	} else {
+		erow* row = editorRowAt(E.cy);
+		editorInsertRow(E.cy+1, &row->chars[E.cx], row->size - E.cx);
+		row = editorRowAt(E.cy);
+		editorRowOwn(row);
+		row->size = E.cx;
+		row->chars[row->size] = '\0';
+		editorUpdateRow(row);
+	}
+	E.cy++;
+	E.cx = 0;
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len) {
+	editorRowOwn(row);
+	editorRowReserve(row, row->size + len + 1);
+	memcpy(&row->chars[row->size], s, len);
+	row->size += len;
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+	E.dirty++;
+}
+
+/* Deletes the `len` bytes of one character, with any combining marks */
+void editorRowDelChar(erow* row, long at, long len) {
+	if(at < 0 || at + len > row->size) return;
+
+	editorRowOwn(row);
+	int tab = memchr(&row->chars[at], '\t', len) != NULL;
+	memmove(&row->chars[at], &row->chars[at+len], row->size - at - len + 1);
+	row->size -= len;
+	if(tab || !editorRowEdit(row, at, -len)) editorUpdateRow(row);
+	E.dirty++;
+}
+
+/* Row Operations */
+
+void editorInsertChar(char c) {
+	// Cursor at new row
+	if(E.cy == E.numRows) editorInsertRow(E.numRows, "", 0);
+	editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+	E.cx++;
+}
+
+/* Inserts text at the cursor, splitting it into rows in one pass. Lines
+ * end in \r, \n or \r\n; every row but the cursor's is rendered lazily */
+void editorInsertText(const char* s, size_t len) {
+	if(E.cy == E.numRows) editorInsertRow(E.numRows, "", 0);
+	erow* row = editorRowAt(E.cy);
+	editorRowOwn(row);
+	long at = E.cx > row->size ? row->size : E.cx;
+
+	size_t lineLen = 0;
+	while(lineLen < len && s[lineLen] != '\r' && s[lineLen] != '\n') ++lineLen;
+	if(lineLen == len) {
+		editorRowReserve(row, row->size + len + 1);
+		memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+		memcpy(&row->chars[at], s, len);
+		row->size += len;
+		E.cx += len;
+		if(memchr(s, '\t', len) || !editorRowEdit(row, at, len)) editorUpdateRow(row);
+		E.dirty++;
+		return;
+	}
+
+	// The text after the cursor moves to the end of the last line
+	size_t tailLen = row->size - at;
+	char* tail = malloc(tailLen);
+	memcpy(tail, &row->chars[at], tailLen);
+	editorRowReserve(row, at + lineLen + 1);
+	memcpy(&row->chars[at], s, lineLen);
+	row->size = at + lineLen;
+	row->chars[row->size] = '\0';
+	editorUpdateRow(row);
+
+	size_t start = lineLen;
+	while(start < len) {
+		start += (s[start] == '\r' && start + 1 < len && s[start + 1] == '\n') ? 2 : 1;
+		size_t end = start;
+		while(end < len && s[end] != '\r' && s[end] != '\n') ++end;
+		E.cy++;
+		if(end < len) {
+			editorInsertRowLazy(E.cy, &s[start], end - start);
+		} else {
+			char* last = malloc(end - start + tailLen);
+			memcpy(last, &s[start], end - start);
+			memcpy(&last[end - start], tail, tailLen);
+			editorInsertRowLazy(E.cy, last, end - start + tailLen);
+			free(last);
+			E.cx = end - start;
+		}
+		start = end;
+	}
+	free(tail);
+	E.dirty++;
+}
+
+void editorDeleteChar() {
+	if(E.cy == E.numRows) return;
+	if(E.cx == 0 && E.cy == 0) return;
+
+	erow* row = editorRowAt(E.cy);
+	if(E.cx > 0) {
+		long from = editorRowStep(row, E.cx, 0);
+		editorRowDelChar(row, from, E.cx - from);
+		E.cx = from;
+	} else {
+		erow* prev = editorRowAt(E.cy-1);
+		E.cx = prev->size;
+		editorRowAppendString(prev, row->chars, row->size);
+		editorDeleteRow(E.cy--);
+	}
+}
+
+/* Line indexing */
+
+/* Every line start in a chunk is counted, but only every ROW_LEAF_MAXth is
+ * kept, as the start of a leaf */
+struct lineChunk {
+	const char* map;
+	size_t start;
+	size_t end;
+	size_t* leaves;
+	size_t numLeaves;
+	size_t cap;
+	size_t numLines;
+	size_t last;
+};
+
+void lineChunkPush(struct lineChunk* chunk, size_t off) {
+	chunk->last = off;
+	if(chunk->numLines++ % ROW_LEAF_MAX) return;
+	if(chunk->numLeaves == chunk->cap) {
+		chunk->cap = chunk->cap ? chunk->cap * 2 : 1024;
+		chunk->leaves = realloc(chunk->leaves, sizeof(size_t) * chunk->cap);
+	}
+	chunk->leaves[chunk->numLeaves++] = off;
 }
 
-void editorInsertNewLine() {
-	if(E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
+/* Each scanner pushes the offset just past every '\n' in its chunk; a
+ * trailing '\r' is left for rowLeafLoad to strip */
+size_t lineChunkScanScalar(struct lineChunk* chunk, size_t i) {
+	const char* p;
+	while(i < chunk->end && (p = memchr(chunk->map + i, '\n', chunk->end - i))) {
+		i = p - chunk->map + 1;
+		lineChunkPush(chunk, i);
+	}
+	return chunk->end;
+}
+
+#ifdef __SSE2__
+size_t lineChunkScanSSE2(struct lineChunk* chunk, size_t i) {
+	const __m128i nl = _mm_set1_epi8('\n');
+	for(; i + 16 <= chunk->end; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(chunk->map + i));
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+		while(mask) {
+			lineChunkPush(chunk, i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+	return lineChunkScanScalar(chunk, i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t lineChunkScanAVX2(struct lineChunk* chunk, size_t i) {
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for(; i + 32 <= chunk->end; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(chunk->map + i));
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+		while(mask) {
+			lineChunkPush(chunk, i + __builtin_ctz(mask) + 1);
+			mask &= mask - 1;
+		}
+	}
+	return lineChunkScanScalar(chunk, i);
+}
+#endif
+
+size_t (*lineChunkScan)(struct lineChunk*, size_t) = lineChunkScanScalar;
+
+void* lineChunkWorker(void* arg) {
+	struct lineChunk* chunk = arg;
+	lineChunkScan(chunk, chunk->start);
+	return NULL;
+}
+
+/* Finds every line start in `map`, scanning chunks in parallel, and returns
+ * mapped leaves over them. Only leaf starts are kept, one offset per
+ * ROW_LEAF_MAX lines; a leaf never spans two chunks, so the last leaf of a
+ * chunk may be short */
+rowNode** editorIndexLines(const char* map, size_t len, long* numLeaves, long* numLines) {
+#ifdef __SSE2__
+	lineChunkScan = lineChunkScanSSE2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if(__builtin_cpu_supports("avx2")) lineChunkScan = lineChunkScanAVX2;
+#endif
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = len / INDEX_CHUNK_MIN;
+	if(threads > (size_t)cpus) threads = cpus;
+	if(threads > INDEX_THREADS_MAX) threads = INDEX_THREADS_MAX;
+	if(threads < 1) threads = 1;
+
+	struct lineChunk chunks[INDEX_THREADS_MAX];
+	pthread_t tids[INDEX_THREADS_MAX];
+	for(size_t t = 0; t < threads; ++t) {
+		chunks[t].map = map;
+		chunks[t].start = len / threads * t;
+		chunks[t].end = (t == threads - 1) ? len : len / threads * (t + 1);
+		chunks[t].leaves = NULL;
+		chunks[t].numLeaves = 0;
+		chunks[t].cap = 0;
+		chunks[t].numLines = 0;
+		chunks[t].last = 0;
+		if(t > 0 && pthread_create(&tids[t], NULL, lineChunkWorker, &chunks[t]) != 0) tids[t] = 0;
+	}
+	lineChunkPush(&chunks[0], 0);
+	lineChunkWorker(&chunks[0]);
+
+	size_t total = 0;
+	for(size_t t = 0; t < threads; ++t) {
+		if(t > 0) {
+			if(tids[t]) pthread_join(tids[t], NULL);
+			else lineChunkWorker(&chunks[t]);
+		}
+	}
+	// A final newline does not start another line
+	struct lineChunk* tail = &chunks[threads - 1];
+	if(tail->numLines && tail->last == len && --tail->numLines % ROW_LEAF_MAX == 0) tail->numLeaves--;
+	for(size_t t = 0; t < threads; ++t) total += chunks[t].numLeaves;
+
+	rowNode** leaves = malloc(sizeof(rowNode*) * total);
+	long n = 0;
+	*numLines = 0;
+	for(size_t t = 0; t < threads; ++t) {
+		for(size_t k = 0; k < chunks[t].numLeaves; ++k) {
+			rowNode* leaf = rowNodeNew(1);
+			leaf->mapped = 1;
+			leaf->mapOff = chunks[t].leaves[k];
+			leaf->count = k + 1 < chunks[t].numLeaves ? ROW_LEAF_MAX : chunks[t].numLines - k * ROW_LEAF_MAX;
+			leaf->numRows = leaf->count;
+			*numLines += leaf->count;
+			leaves[n++] = leaf;
+		}
+		free(chunks[t].leaves);
+	}
+	*numLeaves = n;
+	return leaves;
+}
+
+/* File I/O */
+
+/* Writes out the iovecs, resuming after short writes */
+int editorWriteIov(int fd, struct iovec* iov, int n, size_t* written) {
+	while(n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if(w == -1) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		*written += w;
+		while(n > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0) {
+			iov->iov_base = (char*)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return 0;
+}
+
+void editorSaveAppend(struct saveJob* job, char* s, size_t len) {
+	if(job->numIov > 0) {
+		struct iovec* last = &job->iov[job->numIov - 1];
+		if((char*)last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	if(job->numIov == job->capIov) {
+		job->capIov = job->capIov ? job->capIov * 2 : 1024;
+		job->iov = realloc(job->iov, sizeof(struct iovec) * job->capIov);
+	}
+	job->iov[job->numIov].iov_base = s;
+	job->iov[job->numIov++].iov_len = len;
+}
+
+/* Lines still followed by their own newline in the mapping need no separate
+ * one, so runs of untouched mapped lines collapse into a single iovec */
+void editorSaveAppendLine(struct saveJob* job, char* chars, size_t len) {
+	char* end = chars + len;
+	if(E.map && end >= E.map && end < E.map + E.mapLen && *end == '\n') {
+		editorSaveAppend(job, chars, len + 1);
 	} else {
-		erow* row = &E.row[E.cy];
-		editorInsertRow(E.cy+1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		editorSaveAppend(job, chars, len);
+		editorSaveAppend(job, "\n", 1);
 	}
-	E.cy++;
-	E.cx = 0;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+/* Records the text of every row under node; mapped leaves are read straight
+ * from the mapping */
+void editorSnapshotNode(struct saveJob* job, rowNode* node) {
+	if(!node->isLeaf) {
+		for(int i = 0; i < node->count; ++i) editorSnapshotNode(job, node->children[i]);
+		return;
+	}
+	if(node->mapped) {
+		size_t lines[ROW_LEAF_MAX + 1];
+		rowMapLines(node->mapOff, node->count, lines);
+		for(int i = 0; i < node->count; ++i) {
+			size_t start = lines[i];
+			size_t end = lines[i + 1];
+			if(end > start && E.map[end-1] == '\n') end--;
+			while(end > start && E.map[end-1] == '\r') end--;
+			editorSaveAppendLine(job, &E.map[start], end - start);
+		}
+		return;
+	}
+	for(int i = 0; i < node->count; ++i)
+		editorSaveAppendLine(job, node->rows[i].chars, node->rows[i].size);
+}
+
+/* Syncs the directory holding `path`, so a rename into it is on disk too */
+int editorSyncDir(const char* path) {
+	const char* slash = strrchr(path, '/');
+	char* dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+	int fd = open(dir, O_RDONLY);
+	free(dir);
+	if(fd == -1) return -1;
+	int r = fsync(fd);
+	close(fd);
+	return r;
+}
+
+/* The snapshot goes to a sibling file that is synced and renamed over the
+ * original, and the directory is synced after the rename, so a crash leaves
+ * either the old or the new file, never a torn one */
+void* editorSaveWorker(void* arg) {
+	struct saveJob* job = arg;
+	char* tmp = malloc(strlen(job->filename) + 8);
+	sprintf(tmp, "%s.XXXXXX", job->filename);
+
+	int fd = mkstemp(tmp);
+	if(fd != -1) {
+		struct stat st;
+		if(stat(job->filename, &st) != -1) {
+			fchmod(fd, st.st_mode & 07777);
+		} else {
+			fchmod(fd, 0644 & ~job->umask);
+		}
+		int saved = 1;
+		for(size_t i = 0; i < job->numIov && saved; i += SAVE_IOV_MAX) {
+			int n = job->numIov - i < SAVE_IOV_MAX ? job->numIov - i : SAVE_IOV_MAX;
+			if(editorWriteIov(fd, &job->iov[i], n, &job->written) == -1) saved = 0;
+		}
+		if(saved && fsync(fd) == -1) saved = 0;
+		if(close(fd) == -1) saved = 0;
+		if(saved && rename(tmp, job->filename) == -1) saved = 0;
+		if(!saved) {
+			job->error = errno ? errno : EIO;
+			unlink(tmp);
+		} else if(editorSyncDir(job->filename) == -1) {
+			// The new file is in place already; only its durability is in doubt
+			job->syncError = errno ? errno : EIO;
+		}
+	} else {
+		job->error = errno;
+	}
+	free(tmp);
+	write(E.saveDone[1], "", 1);
+	return NULL;
+}
+
+/* Maps the file and indexes its line starts; leaves build their rows on first touch */
+int editorOpenMapped(FILE* fp) {
+	struct stat st;
+	if(fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+
+	char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if(map == MAP_FAILED) return -1;
+
+	size_t len = st.st_size;
+	long numLeaves, numLines;
+	rowNode** leaves = editorIndexLines(map, len, &numLeaves, &numLines);
+
+	E.map = map;
+	E.mapLen = len;
+	rowStoreBuild(leaves, numLeaves);
+	free(leaves);
+	E.numRows = numLines;
+	editorSyntaxInvalidate(0);
+	editorSyntaxInvalidate(E.numRows - 1);
+	E.hlJob.pending = 1;
+	return 0;
+}
+
+void editorOpen(char* filename) {
+	free(E.filename);
+	E.filename = strdup(filename);
+
+	editorSelectSyntaxHighlight();
+
+	FILE *fp = fopen(filename, "r");
+	if(!fp) die("fopen");
+
+	if(editorOpenMapped(fp) == 0) {
+		fclose(fp);
+		E.dirty = 0;
+		return;
+	}
+
+	char* line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+
+	while((linelen = getline(&line, &linecap, fp)) != -1) {
+		while(linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) linelen--;
+		editorInsertRow(E.numRows, line, linelen);
+	}
+
+	free(line);
+	fclose(fp);
+	E.dirty = 0;
+}
+
+/* Snapshots the rows and hands them to a worker thread to write. Heap text
+ * the snapshot points at is copied before its next edit rather than changed */
+void editorSave() {
+	if(E.save) {
+		editorSetStatusMessage("Still saving %s", E.save->filename);
+		return;
+	}
+	if(E.filename == NULL) {
+		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if(E.filename == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	struct saveJob* job = malloc(sizeof(struct saveJob));
+	job->gen = E.saveGen++;
+	job->dirty = E.dirty;
+	// umask can only be read by setting it, which other threads would see
+	job->umask = umask(0);
+	umask(job->umask);
+	job->filename = strdup(E.filename);
+	job->iov = NULL;
+	job->numIov = 0;
+	job->capIov = 0;
+	job->orphans = NULL;
+	job->orphanCaps = NULL;
+	job->numOrphans = 0;
+	job->capOrphans = 0;
+	job->written = 0;
+	job->error = 0;
+	job->syncError = 0;
+	editorSnapshotNode(job, E.rowRoot);
+
+	E.save = job;
+	editorSetStatusMessage("Saving %s...", job->filename);
+	job->threaded = pthread_create(&job->thread, NULL, editorSaveWorker, job) == 0;
+	if(!job->threaded) editorSaveWorker(job);
 }
 
-void editorRowDelChar(erow* row, int at) {
-	if(at < 0 || at > row->size) return;
+/* Reaps the finished save; edits made while it ran stay dirty */
+void editorSaveFinish() {
+	struct saveJob* job = E.save;
+	if(job == NULL) return;
+	char drain[16];
+	while(read(E.saveDone[0], drain, sizeof(drain)) > 0);
+	if(job->threaded) pthread_join(job->thread, NULL);
+
+	if(job->error == 0) {
+		if(job->syncError == 0) {
+			editorSetStatusMessage("%zu bytes saved to %s", job->written, job->filename);
+		} else {
+			editorSetStatusMessage("Warning: directory not synced (%s); %zu bytes saved to %s",
+				strerror(job->syncError), job->written, job->filename);
+		}
+		E.dirty -= job->dirty;
+	} else {
+		editorSetStatusMessage("Couldn't save; I/O error: %s", strerror(job->error));
+	}
+	for(size_t i = 0; i < job->numOrphans; ++i) rowMemFree(MEM_CHARS, job->orphans[i], job->orphanCaps[i]);
+	free(job->orphans);
+	free(job->orphanCaps);
+	free(job->iov);
+	free(job->filename);
+	free(job);
+	E.save = NULL;
+}
+
+/* Regex */
+
+/* Patterns are parsed into a tree, compiled to a Thompson NFA forwards and
+ * backwards, and run as DFAs whose states are built the first time a
+ * transition is taken. Matching is leftmost-longest, within a single row */
+
+enum regexNodeType {
+	RE_EMPTY,
+	RE_SET,
+	RE_CAT,
+	RE_ALT,
+	RE_STAR,
+	RE_PLUS,
+	RE_QUEST,
+	RE_REPEAT
+};
+
+/* states is how many NFA states the node compiles to, known as it is parsed
+ * so patterns over REGEX_NFA_MAX are refused before anything is built */
+struct regexNode {
+	int type;
+	int left;
+	int right;
+	int min;
+	int max;
+	long states;
+	unsigned char set[32];
+};
+
+/* Split states only have epsilon edges (out1 may be -1); the others consume
+ * one byte of `set`, except the single match state */
+struct nfaState {
+	int split;
+	int match;
+	int out;
+	int out1;
+	unsigned char set[32];
+};
+
+struct nfa {
+	struct nfaState* states;
+	int numStates;
+	int cap;
+	int start;
+	int match;
+};
+
+struct regex {
+	struct regexNode* nodes;
+	int numNodes;
+	int capNodes;
+	int bol;
+	int eol;
+	char literal[REGEX_LITERAL_MAX];
+	int literalLen;
+	struct nfa fwd;
+	struct nfa rev;
+};
+
+#define DFA_ACCEPT (1<<0)
+#define DFA_DEAD (1<<1)
+
+struct dfaState {
+	int* set;
+	int n;
+};
+
+/* A lazily built DFA over one NFA; unanchored ones may start a match at
+ * every byte. Each scanning thread has its own. Transitions are one flat
+ * table of 256 entries per state, holding the target already multiplied by
+ * 256 or -1 if not built yet; the accept and dead flags are kept apart */
+struct dfa {
+	struct nfa* nfa;
+	int unanchored;
+	int start;
+	struct dfaState* states;
+	int* trans;
+	unsigned char* kind;
+	int numStates;
+	int cap;
+	int* table;
+	int* mark;
+	int gen;
+	int* stack;
+	int* buf;
+};
+
+struct regexMatcher {
+	struct dfa fwd;
+	struct dfa rev;
+	unsigned char* starts;
+	size_t cap;
+};
+
+#define RE_SET_ADD(set, c) ((set)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define RE_SET_HAS(set, c) ((set)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+int regexNode(struct regex* re, int type, int left, int right) {
+	if(re->numNodes == re->capNodes) {
+		re->capNodes = re->capNodes ? re->capNodes * 2 : 32;
+		re->nodes = realloc(re->nodes, sizeof(struct regexNode) * re->capNodes);
+	}
+	struct regexNode* node = &re->nodes[re->numNodes];
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->min = node->max = 0;
+	memset(node->set, 0, sizeof(node->set));
+	long l = left != -1 ? re->nodes[left].states : 0;
+	long r = right != -1 ? re->nodes[right].states : 0;
+	switch(type) {
+		case RE_SET: node->states = 2; break;
+		case RE_CAT: node->states = l + r; break;
+		case RE_ALT: node->states = l + r + 2; break;
+		case RE_STAR:
+		case RE_PLUS:
+		case RE_QUEST: node->states = l + 2; break;
+		default: node->states = 1; break;
+	}
+	return re->numNodes++;
+}
+
+/* States of x{min,max}: an entry, min copies of x, then max-min optional
+ * copies or one starred one, each optional copy with two more */
+long regexRepeatStates(struct regexNode* node, long sub) {
+	long optional = node->max == -1 ? 1 : node->max - node->min;
+	return 1 + node->min * sub + optional * (sub + 2);
+}
+
+/* The operands of a chain of concatenations, in order. Chains grow down their
+ * left side one atom at a time, so they are walked rather than recursed into */
+int* regexCatParts(struct regex* re, int n, int* count) {
+	*count = 1;
+	for(int c = n; re->nodes[c].type == RE_CAT; c = re->nodes[c].left) (*count)++;
+	int* parts = malloc(sizeof(int) * *count);
+	int c = n;
+	for(int i = *count - 1; i > 0; --i, c = re->nodes[c].left) parts[i] = re->nodes[c].right;
+	parts[0] = c;
+	return parts;
+}
+
+char regexEscapeChar(char c) {
+	switch(c) {
+		case 't': return '\t';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		default: return c;
+	}
+}
+
+/* Adds an escaped character or one of the \d \w \s classes and their negations */
+void regexEscape(char c, unsigned char* set) {
+	unsigned char cls[32];
+	memset(cls, 0, sizeof(cls));
+	switch(c | 0x20) {
+		case 'd':
+			for(int ch = '0'; ch <= '9'; ++ch) RE_SET_ADD(cls, ch);
+			break;
+		case 'w':
+			for(int ch = 0; ch < 256; ++ch) if(isalnum(ch) || ch == '_') RE_SET_ADD(cls, ch);
+			break;
+		case 's':
+			for(int ch = 0; ch < 256; ++ch) if(isspace(ch)) RE_SET_ADD(cls, ch);
+			break;
+		default:
+			RE_SET_ADD(set, regexEscapeChar(c));
+			return;
+	}
+	for(int i = 0; i < 32; ++i) set[i] |= isupper(c) ? ~cls[i] : cls[i];
+}
+
+int regexParseClass(const char** p, unsigned char* set) {
+	const char* c = *p + 1;
+	int negate = *c == '^';
+	if(negate) c++;
+	for(int first = 1; *c && (*c != ']' || first); first = 0) {
+		unsigned char lo = *c++;
+		if(lo == '\\' && *c) {
+			if(strchr("dDwWsS", *c)) {
+				regexEscape(*c++, set);
+				continue;
+			}
+			lo = regexEscapeChar(*c++);
+		}
+		if(c[0] == '-' && c[1] && c[1] != ']') {
+			unsigned char hi = c[1];
+			c += 2;
+			if(hi == '\\' && *c) hi = regexEscapeChar(*c++);
+			for(int ch = lo; ch <= hi; ++ch) RE_SET_ADD(set, ch);
+		} else {
+			RE_SET_ADD(set, lo);
+		}
+	}
+	if(*c != ']') return -1;
+	if(negate) for(int i = 0; i < 32; ++i) set[i] = ~set[i];
+	*p = c + 1;
+	return 0;
+}
+
+int regexParseAlt(struct regex* re, const char** p, int depth);
+
+int regexParseAtom(struct regex* re, const char** p, int depth) {
+	const char* c = *p;
+	if(*c == '(') {
+		*p = c + 1;
+		int n = regexParseAlt(re, p, depth + 1);
+		if(n == -1 || **p != ')') return -1;
+		(*p)++;
+		return n;
+	}
+	if(*c == '*' || *c == '+' || *c == '?') return -1;
+
+	int n = regexNode(re, RE_SET, -1, -1);
+	unsigned char* set = re->nodes[n].set;
+	if(*c == '.') {
+		memset(set, 0xff, 32);
+		*p = c + 1;
+	} else if(*c == '[') {
+		if(regexParseClass(p, set) == -1) return -1;
+	} else if(*c == '\\') {
+		if(!c[1]) return -1;
+		regexEscape(c[1], set);
+		*p = c + 2;
+	} else {
+		RE_SET_ADD(set, *c);
+		*p = c + 1;
+	}
+	return n;
+}
+
+int regexParseRepeat(struct regex* re, const char** p, int depth) {
+	int n = regexParseAtom(re, p, depth);
+	while(n != -1) {
+		const char* c = *p;
+		// Each operator nests the atom one level deeper
+		if((*c == '*' || *c == '+' || *c == '?' || *c == '{') && ++depth > REGEX_DEPTH_MAX) return -1;
+		if(*c == '*' || *c == '+' || *c == '?') {
+			n = regexNode(re, *c == '*' ? RE_STAR : *c == '+' ? RE_PLUS : RE_QUEST, n, -1);
+			*p = c + 1;
+		} else if(*c == '{' && isdigit(c[1])) {
+			char* end;
+			long min = strtol(c + 1, &end, 10), max = min;
+			if(*end == ',') max = isdigit(end[1]) ? strtol(end + 1, &end, 10) : (end++, -1);
+			if(*end != '}' || min > REGEX_REPEAT_MAX || max > REGEX_REPEAT_MAX || (max != -1 && max < min)) return -1;
+			n = regexNode(re, RE_REPEAT, n, -1);
+			re->nodes[n].min = min;
+			re->nodes[n].max = max;
+			re->nodes[n].states = regexRepeatStates(&re->nodes[n], re->nodes[re->nodes[n].left].states);
+			*p = end + 1;
+		} else {
+			break;
+		}
+		if(re->nodes[n].states > REGEX_NFA_MAX) return -1;
+	}
+	return n;
+}
+
+int regexParseCat(struct regex* re, const char** p, int depth) {
+	int n = regexNode(re, RE_EMPTY, -1, -1);
+	while(**p && **p != '|' && **p != ')') {
+		int atom = regexParseRepeat(re, p, depth);
+		if(atom == -1) return -1;
+		n = regexNode(re, RE_CAT, n, atom);
+		if(re->nodes[n].states > REGEX_NFA_MAX) return -1;
+	}
+	return n;
+}
+
+int regexParseAlt(struct regex* re, const char** p, int depth) {
+	if(depth > REGEX_DEPTH_MAX) return -1;
+	int n = regexParseCat(re, p, depth);
+	while(n != -1 && **p == '|') {
+		(*p)++;
+		int right = regexParseCat(re, p, depth);
+		if(right == -1) return -1;
+		n = regexNode(re, RE_ALT, n, right);
+		if(re->nodes[n].states > REGEX_NFA_MAX) return -1;
+	}
+	return n;
+}
+
+/* Finds the longest run of single bytes that every match contains, so rows
+ * without it can be skipped by the plain scanner */
+void regexLiteral(struct regex* re, int n, char* run, int* runLen) {
+	struct regexNode* node = &re->nodes[n];
+	if(node->type == RE_CAT) {
+		int count;
+		int* parts = regexCatParts(re, n, &count);
+		for(int i = 0; i < count; ++i) regexLiteral(re, parts[i], run, runLen);
+		free(parts);
+		return;
+	}
+	if(node->type == RE_EMPTY) return;
+
+	int byte = -1, count = 0;
+	for(int c = 0; node->type == RE_SET && c < 256 && count < 2; ++c)
+		if(RE_SET_HAS(node->set, c)) {
+			byte = c;
+			count++;
+		}
+	if(count != 1 || *runLen == REGEX_LITERAL_MAX) {
+		*runLen = 0;
+		return;
+	}
+	run[(*runLen)++] = byte;
+	if(*runLen > re->literalLen) {
+		memcpy(re->literal, run, *runLen);
+		re->literalLen = *runLen;
+	}
+}
+
+int nfaAdd(struct nfa* nfa, int split, int out, int out1) {
+	if(nfa->numStates == nfa->cap) {
+		nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+		nfa->states = realloc(nfa->states, sizeof(struct nfaState) * nfa->cap);
+	}
+	struct nfaState* st = &nfa->states[nfa->numStates];
+	st->split = split;
+	st->match = 0;
+	st->out = out;
+	st->out1 = out1;
+	memset(st->set, 0, sizeof(st->set));
+	return nfa->numStates++;
+}
+
+/* Emits the fragment for node n and returns its entry; *end is a dangling
+ * epsilon state to chain on from. Reversed NFAs match the reversed language */
+int regexCompileNode(struct regex* re, struct nfa* nfa, int n, int reverse, int* end) {
+	struct regexNode node = re->nodes[n];
+	int s, e, a, ae, b, be;
+	switch(node.type) {
+		case RE_SET:
+			s = nfaAdd(nfa, 0, -1, -1);
+			memcpy(nfa->states[s].set, node.set, sizeof(node.set));
+			e = nfaAdd(nfa, 1, -1, -1);
+			nfa->states[s].out = e;
+			break;
+		case RE_CAT: {
+			int count;
+			int* parts = regexCatParts(re, n, &count);
+			s = regexCompileNode(re, nfa, parts[reverse ? count - 1 : 0], reverse, &e);
+			for(int i = 1; i < count; ++i) {
+				a = regexCompileNode(re, nfa, parts[reverse ? count - 1 - i : i], reverse, &ae);
+				nfa->states[e].out = a;
+				e = ae;
+			}
+			free(parts);
+			break;
+		}
+		case RE_ALT:
+			a = regexCompileNode(re, nfa, node.left, reverse, &ae);
+			b = regexCompileNode(re, nfa, node.right, reverse, &be);
+			e = nfaAdd(nfa, 1, -1, -1);
+			s = nfaAdd(nfa, 1, a, b);
+			nfa->states[ae].out = e;
+			nfa->states[be].out = e;
+			break;
+		case RE_STAR:
+		case RE_PLUS:
+		case RE_QUEST:
+			a = regexCompileNode(re, nfa, node.left, reverse, &ae);
+			e = nfaAdd(nfa, 1, -1, -1);
+			b = nfaAdd(nfa, 1, a, e);
+			nfa->states[ae].out = node.type == RE_QUEST ? e : b;
+			s = node.type == RE_PLUS ? a : b;
+			break;
+		case RE_REPEAT:
+			// x{m,n} is m copies of x followed by n-m optional ones, or by x*
+			s = e = nfaAdd(nfa, 1, -1, -1);
+			for(int i = 0; i < node.min; ++i) {
+				a = regexCompileNode(re, nfa, node.left, reverse, &ae);
+				nfa->states[e].out = a;
+				e = ae;
+			}
+			for(int i = node.min; i < node.max || (node.max == -1 && i == node.min); ++i) {
+				a = regexCompileNode(re, nfa, node.left, reverse, &ae);
+				be = nfaAdd(nfa, 1, -1, -1);
+				b = nfaAdd(nfa, 1, a, be);
+				nfa->states[ae].out = node.max == -1 ? b : be;
+				nfa->states[e].out = b;
+				e = be;
+			}
+			break;
+		default:
+			s = e = nfaAdd(nfa, 1, -1, -1);
+			break;
+	}
+	*end = e;
+	return s;
+}
+
+int regexCompileNfa(struct regex* re, struct nfa* nfa, int root, int reverse) {
+	nfa->states = NULL;
+	nfa->numStates = 0;
+	nfa->cap = 0;
+	int end;
+	nfa->start = regexCompileNode(re, nfa, root, reverse, &end);
+	nfa->match = nfaAdd(nfa, 0, -1, -1);
+	nfa->states[nfa->match].match = 1;
+	nfa->states[end].out = nfa->match;
+	return nfa->numStates > REGEX_NFA_MAX ? -1 : 0;
+}
+
+void regexFree(struct regex* re) {
+	if(re == NULL) return;
+	free(re->nodes);
+	free(re->fwd.states);
+	free(re->rev.states);
+	free(re);
+}
+
+/* Compiles a pattern; ^ and $ are only special at its very start and end.
+ * Returns NULL if it is malformed */
+struct regex* regexCompile(const char* pattern) {
+	struct regex* re = calloc(1, sizeof(struct regex));
+	size_t len = strlen(pattern);
+	char* body = strdup(pattern);
+	char* p = body;
+	if(*p == '^') {
+		re->bol = 1;
+		p++;
+	}
+	size_t slashes = 0;
+	while(len >= 2 + slashes && body[len - 2 - slashes] == '\\') slashes++;
+	if(body + len > p && body[len - 1] == '$' && slashes % 2 == 0) {
+		re->eol = 1;
+		body[len - 1] = '\0';
+	}
+
+	const char* at = p;
+	int root = regexParseAlt(re, &at, 0);
+	int ok = root != -1 && *at == '\0';
+	free(body);
+	if(!ok || regexCompileNfa(re, &re->fwd, root, 0) == -1 || regexCompileNfa(re, &re->rev, root, 1) == -1) {
+		regexFree(re);
+		return NULL;
+	}
+	char run[REGEX_LITERAL_MAX];
+	int runLen = 0;
+	regexLiteral(re, root, run, &runLen);
+	return re;
+}
+
+void dfaInit(struct dfa* d, struct nfa* nfa, int unanchored) {
+	d->nfa = nfa;
+	d->unanchored = unanchored;
+	d->start = -1;
+	d->states = NULL;
+	d->trans = NULL;
+	d->kind = NULL;
+	d->numStates = 0;
+	d->cap = 0;
+	d->table = malloc(sizeof(int) * DFA_TABLE_SIZE);
+	memset(d->table, 0xff, sizeof(int) * DFA_TABLE_SIZE);
+	d->mark = calloc(nfa->numStates, sizeof(int));
+	d->gen = 0;
+	d->stack = malloc(sizeof(int) * (2 * nfa->numStates + 2));
+	d->buf = malloc(sizeof(int) * nfa->numStates);
+}
+
+/* Drops every state once the cache is full, bounding memory per pattern */
+void dfaFlush(struct dfa* d) {
+	for(int i = 0; i < d->numStates; ++i) free(d->states[i].set);
+	d->numStates = 0;
+	d->start = -1;
+	memset(d->table, 0xff, sizeof(int) * DFA_TABLE_SIZE);
+}
+
+void dfaFree(struct dfa* d) {
+	dfaFlush(d);
+	free(d->states);
+	free(d->trans);
+	free(d->kind);
+	free(d->table);
+	free(d->mark);
+	free(d->stack);
+	free(d->buf);
+}
+
+/* Adds the byte-consuming and match states reachable from id to d->buf */
+void dfaClosure(struct dfa* d, int id, int* n) {
+	int top = 0;
+	d->stack[top++] = id;
+	while(top) {
+		int i = d->stack[--top];
+		if(i == -1 || d->mark[i] == d->gen) continue;
+		d->mark[i] = d->gen;
+		struct nfaState* st = &d->nfa->states[i];
+		if(st->split) {
+			d->stack[top++] = st->out;
+			d->stack[top++] = st->out1;
+		} else {
+			d->buf[(*n)++] = i;
+		}
+	}
+}
+
+int dfaCompareInt(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+/* Finds or creates the state for d->buf[0..n); sets *flushed if the cache
+ * had to be emptied to make room */
+int dfaAdd(struct dfa* d, int n, int* flushed) {
+	qsort(d->buf, n, sizeof(int), dfaCompareInt);
+	unsigned int hash = 2166136261u;
+	for(int i = 0; i < n; ++i) hash = (hash ^ d->buf[i]) * 16777619u;
+
+	unsigned int h = hash & (DFA_TABLE_SIZE - 1);
+	for(; d->table[h] != -1; h = (h + 1) & (DFA_TABLE_SIZE - 1)) {
+		struct dfaState* st = &d->states[d->table[h]];
+		if(st->n == n && !memcmp(st->set, d->buf, sizeof(int) * n)) return d->table[h];
+	}
+	if(d->numStates == DFA_STATES_MAX) {
+		dfaFlush(d);
+		*flushed = 1;
+		h = hash & (DFA_TABLE_SIZE - 1);
+	}
+	if(d->numStates == d->cap) {
+		d->cap = d->cap ? d->cap * 2 : 16;
+		d->states = realloc(d->states, sizeof(struct dfaState) * d->cap);
+		d->trans = realloc(d->trans, sizeof(int) * 256 * d->cap);
+		d->kind = realloc(d->kind, d->cap);
+	}
+	struct dfaState* st = &d->states[d->numStates];
+	st->set = malloc(sizeof(int) * (n ? n : 1));
+	memcpy(st->set, d->buf, sizeof(int) * n);
+	st->n = n;
+	memset(&d->trans[d->numStates * 256], 0xff, sizeof(int) * 256);
+	d->kind[d->numStates] = n == 0 && !d->unanchored ? DFA_DEAD : 0;
+	for(int i = 0; i < n; ++i) if(d->buf[i] == d->nfa->match) d->kind[d->numStates] = DFA_ACCEPT;
+	d->table[h] = d->numStates;
+	return d->numStates++;
+}
+
+int dfaStart(struct dfa* d) {
+	if(d->start == -1) {
+		int n = 0, flushed = 0;
+		d->gen++;
+		dfaClosure(d, d->nfa->start, &n);
+		d->start = dfaAdd(d, n, &flushed);
+	}
+	return d->start;
+}
+
+int dfaStep(struct dfa* d, int si, unsigned char c) {
+	int next = d->trans[si * 256 + c];
+	if(next != -1) return next >> 8;
+
+	int n = 0, flushed = 0;
+	d->gen++;
+	struct dfaState* st = &d->states[si];
+	for(int i = 0; i < st->n; ++i) {
+		struct nfaState* ns = &d->nfa->states[st->set[i]];
+		if(!ns->match && RE_SET_HAS(ns->set, c)) dfaClosure(d, ns->out, &n);
+	}
+	if(d->unanchored) dfaClosure(d, d->nfa->start, &n);
+	next = dfaAdd(d, n, &flushed);
+	if(!flushed) d->trans[si * 256 + c] = next << 8;
+	return next;
+}
 
-	memmove(&row->chars[at], &row->chars[at+1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
-	E.dirty++;
+struct regexMatcher* regexMatcherNew(struct regex* re) {
+	struct regexMatcher* m = malloc(sizeof(struct regexMatcher));
+	dfaInit(&m->fwd, &re->fwd, 0);
+	dfaInit(&m->rev, &re->rev, !re->eol);
+	m->starts = NULL;
+	m->cap = 0;
+	return m;
 }
 
-/* Row Operations */
+void regexMatcherFree(struct regexMatcher* m) {
+	if(m == NULL) return;
+	dfaFree(&m->fwd);
+	dfaFree(&m->rev);
+	free(m->starts);
+	free(m);
+}
 
-void editorInsertChar(char c) {
-	// Cursor at new row
-	if(E.cy == E.numRows) editorInsertRow(E.numRows, "", 0);
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+/* End of the longest match starting at `from`, or `from` if there is none */
+size_t regexLongest(struct regexMatcher* m, struct regex* re, const char* text, size_t len, size_t from) {
+	struct dfa* d = &m->fwd;
+	size_t best = from;
+	int at = dfaStart(d) << 8;
+	for(size_t i = from; i < len; ++i) {
+		int next = d->trans[at + (unsigned char)text[i]];
+		at = next != -1 ? next : dfaStep(d, at >> 8, text[i]) << 8;
+		if(d->kind[at >> 8] & DFA_DEAD) break;
+		if((d->kind[at >> 8] & DFA_ACCEPT) && (!re->eol || i + 1 == len)) best = i + 1;
+	}
+	return best;
 }
 
-void editorDeleteChar() {
-	if(E.cy == E.numRows) return;
-	if(E.cx == 0 && E.cy == 0) return;
+/* Marks every offset of a row that a match starts at, in one backward pass */
+void regexMarkStarts(struct regexMatcher* m, const char* text, size_t len) {
+	if(len > m->cap) {
+		m->cap = len;
+		m->starts = realloc(m->starts, m->cap);
+	}
+	memset(m->starts, 0, len);
+	struct dfa* d = &m->rev;
+	int at = dfaStart(d) << 8;
+	int* trans = d->trans;
+	unsigned char* kind = d->kind;
+	for(size_t i = len; i-- > 0; ) {
+		int next = trans[at + (unsigned char)text[i]];
+		if(next == -1) {
+			next = dfaStep(d, at >> 8, text[i]) << 8;
+			trans = d->trans;
+			kind = d->kind;
+		}
+		at = next;
+		if(kind[at >> 8]) {
+			if(kind[at >> 8] & DFA_DEAD) break;
+			m->starts[i] = 1;
+		}
+	}
+}
 
-	erow* row = &E.row[E.cy];
-	if(E.cx > 0) {
-		editorRowDelChar(row, (E.cx--) - 1);
-	} else {
-		E.cx = E.row[E.cy-1].size;
-		editorRowAppendString(&E.row[E.cy-1], row->chars, row->size);
-		editorDeleteRow(E.cy--);
+/* Offset of the next leftmost-longest, non-empty match at or after i in a
+ * row marked by regexMarkStarts, or len if there is none */
+size_t regexNext(struct regexMatcher* m, struct regex* re, const char* text, size_t len, size_t i, size_t* matchLen) {
+	while(i < len) {
+		unsigned char* next = memchr(&m->starts[i], 1, len - i);
+		if(next == NULL || (re->bol && next != m->starts)) break;
+		size_t from = next - m->starts;
+		size_t end = regexLongest(m, re, text, len, from);
+		if(end > from) {
+			*matchLen = end - from;
+			return from;
+		}
+		i = from + 1;
+	}
+	return len;
+}
+/* Search */
+
+/* Each scanner returns the offset of the first occurrence of the needle at or
+ * after `i`, or `len` if there is none */
+size_t searchScanScalar(const char* hay, size_t len, const char* needle, size_t nlen, size_t i) {
+	const char* p;
+	while(i + nlen <= len && (p = memchr(hay + i, needle[0], len - nlen + 1 - i))) {
+		i = p - hay;
+		if(!memcmp(p, needle, nlen)) return i;
+		i++;
 	}
+	return len;
 }
 
-/* File I/O */
+/* The vector scanners compare the first and the last needle byte at 16 or 32
+ * positions at once and only memcmp where both agree */
+#ifdef __SSE2__
+size_t searchScanSSE2(const char* hay, size_t len, const char* needle, size_t nlen, size_t i) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	for(; i + nlen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(hay + i + nlen - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		while(mask) {
+			size_t at = i + __builtin_ctz(mask);
+			if(!memcmp(hay + at, needle, nlen)) return at;
+			mask &= mask - 1;
+		}
+	}
+	return searchScanScalar(hay, len, needle, nlen, i);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+size_t searchScanAVX2(const char* hay, size_t len, const char* needle, size_t nlen, size_t i) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+	for(; i + nlen - 1 + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(hay + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(hay + i + nlen - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		while(mask) {
+			size_t at = i + __builtin_ctz(mask);
+			if(!memcmp(hay + at, needle, nlen)) return at;
+			mask &= mask - 1;
+		}
+	}
+	return searchScanScalar(hay, len, needle, nlen, i);
+}
+#endif
 
-char* editorRowsToString(int* buflen) {
-	int totlen = 0;
-	for(int j = 0; j < E.numRows; ++j)
-		totlen += E.row[j].size + 1;
-	*buflen = totlen;
+size_t (*searchScan)(const char*, size_t, const char*, size_t, size_t) = searchScanScalar;
 
-	char *buf = malloc(totlen * sizeof(char));
-	char* p = buf;
-	for(int j = 0; j < E.numRows; ++j) {
-		memcpy(p, E.row[j].chars, E.row[j].size);
-		p += E.row[j].size;
-		*(p++) = '\n';
+void searchPush(struct searchBatch* b, long row, long col, long len) {
+	if(b->numMatches == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 1024;
+		b->matches = realloc(b->matches, sizeof(struct searchMatch) * b->cap);
 	}
-	return buf;
+	struct searchMatch* m = &b->matches[b->numMatches++];
+	m->row = row;
+	m->col = col;
+	m->len = len;
 }
 
-void editorOpen(char* filename) {
-	free(E.filename);
-	E.filename = strdup(filename);
+void searchRegexRow(struct searchState* s, struct regexMatcher* rm, struct searchBatch* b, long row, const char* text, size_t len) {
+	struct regex* re = s->re;
+	if(re->literalLen && searchScan(text, len, re->literal, re->literalLen, 0) >= len) return;
+	regexMarkStarts(rm, text, len);
+	size_t at = 0, matchLen;
+	while((at = regexNext(rm, s->re, text, len, at, &matchLen)) < len) {
+		searchPush(b, row, at, matchLen);
+		at += matchLen;
+	}
+}
 
-	editorSelectSyntaxHighlight();
+/* Collects the matches in a leaf whose first row is `first`. A leaf that was
+ * never loaded is scanned as one block of the mapping, or line by line for a
+ * regex, which runs on the caller's own matcher */
+void searchLeaf(struct searchState* s, struct regexMatcher* rm, struct searchBatch* b, rowNode* leaf, long first) {
+	int mapped = __atomic_load_n(&leaf->mapped, __ATOMIC_ACQUIRE);
+	size_t lines[ROW_LEAF_MAX + 1];
+	if(mapped) rowMapLines(leaf->mapOff, leaf->count, lines);
+	if(mapped && s->re) {
+		// Lines without the pattern's literal are skipped in one pass over the block
+		struct regex* re = s->re;
+		for(int i = 0; i < leaf->count; ++i) {
+			if(re->literalLen) {
+				size_t at = searchScan(E.map, lines[leaf->count], re->literal, re->literalLen, lines[i]);
+				if(at >= lines[leaf->count]) break;
+				while(lines[i + 1] <= at) ++i;
+			}
+			size_t end = lines[i + 1];
+			if(end > lines[i] && E.map[end-1] == '\n') end--;
+			while(end > lines[i] && E.map[end-1] == '\r') end--;
+			searchRegexRow(s, rm, b, first + i, &E.map[lines[i]], end - lines[i]);
+		}
+		return;
+	}
+	if(mapped) {
+		size_t end = lines[leaf->count];
+		size_t at = lines[0];
+		int line = 0;
+		while((at = searchScan(E.map, end, s->query, s->len, at)) < end) {
+			while(lines[line + 1] <= at) ++line;
+			searchPush(b, first + line, at - lines[line], s->len);
+			at++;
+		}
+		return;
+	}
+	for(int i = 0; i < leaf->count; ++i) {
+		erow* row = &leaf->rows[i];
+		if(s->re) {
+			searchRegexRow(s, rm, b, first + i, row->chars, row->size);
+			continue;
+		}
+		size_t at = 0;
+		while((at = searchScan(row->chars, row->size, s->query, s->len, at)) < (size_t)row->size) {
+			searchPush(b, first + i, at, s->len);
+			at++;
+		}
+	}
+}
 
-	FILE *fp = fopen(filename, "r");
-	if(!fp) die("fopen");
+void searchRunBatch(struct searchState* s, struct regexMatcher* rm, struct searchBatch* b) {
+	long first = b->firstRow;
+	for(int i = 0; i < b->numLeaves && !__atomic_load_n(&s->cancel, __ATOMIC_RELAXED); ++i) {
+		searchLeaf(s, rm, b, b->leaves[i], first);
+		first += b->leaves[i]->numRows;
+	}
+	__atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+}
 
-	char* line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
+/* Workers take batches in order, so the start of the buffer is done first */
+void* searchWorker(void* arg) {
+	struct searchState* s = arg;
+	struct regexMatcher* rm = s->re ? regexMatcherNew(s->re) : NULL;
+	int i;
+	while(!__atomic_load_n(&s->cancel, __ATOMIC_RELAXED) &&
+			(i = __atomic_fetch_add(&s->nextBatch, 1, __ATOMIC_RELAXED)) < s->numBatches) {
+		searchRunBatch(s, rm, &s->batches[i]);
+		write(E.searchWake[1], "", 1);
+	}
+	regexMatcherFree(rm);
+	return NULL;
+}
 
-	while((linelen = getline(&line, &linecap, fp)) != -1) {
-		while(linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) linelen--;
-		editorInsertRow(E.numRows, line, linelen);
+void searchCollectLeaves(rowNode* node, rowNode*** leaves, int* n, int* cap) {
+	if(node->isLeaf) {
+		if(*n == *cap) {
+			*cap = *cap ? *cap * 2 : 256;
+			*leaves = realloc(*leaves, sizeof(rowNode*) * *cap);
+		}
+		(*leaves)[(*n)++] = node;
+		return;
 	}
+	for(int i = 0; i < node->count; ++i) searchCollectLeaves(node->children[i], leaves, n, cap);
+}
 
-	free(line);
-	fclose(fp);
-	E.dirty = 0;
+/* Stops the scan in flight, if any, and drops its unmerged results */
+void searchCancel(struct searchState* s) {
+	if(s->batches == NULL) return;
+	__atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+	for(int t = 0; t < s->numThreads; ++t) pthread_join(s->threads[t], NULL);
+	for(int i = 0; i < s->numBatches; ++i) free(s->batches[i].matches);
+	free(s->batches);
+	free(s->leaves);
+	s->batches = NULL;
+	s->leaves = NULL;
+	s->numBatches = 0;
+	s->numThreads = 0;
+	s->cancel = 0;
 }
 
-void editorSave() {
-	if(E.filename == NULL) {
-		E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if(E.filename == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
+/* Merges the batches finished so far into the index, in order */
+void searchMerge(struct searchState* s) {
+	while(s->merged < s->numBatches && __atomic_load_n(&s->batches[s->merged].done, __ATOMIC_ACQUIRE)) {
+		struct searchBatch* b = &s->batches[s->merged++];
+		if(s->numMatches + b->numMatches > s->cap) {
+			while(s->numMatches + b->numMatches > s->cap) s->cap = s->cap ? s->cap * 2 : 1024;
+			s->matches = realloc(s->matches, sizeof(struct searchMatch) * s->cap);
 		}
-		editorSelectSyntaxHighlight();
+		if(b->numMatches) memcpy(&s->matches[s->numMatches], b->matches, sizeof(struct searchMatch) * b->numMatches);
+		s->numMatches += b->numMatches;
+		free(b->matches);
+		b->matches = NULL;
 	}
+	if(s->batches && s->merged == s->numBatches) searchCancel(s);
+}
 
-	int len;
-	char* buf = editorRowsToString(&len);
+/* Splits the buffer into batches of leaves and scans them on a worker pool.
+ * A buffer that fits in one batch is scanned right away */
+void searchStart(struct searchState* s) {
+	int numLeaves = 0, cap = 0;
+	s->leaves = NULL;
+	searchCollectLeaves(E.rowRoot, &s->leaves, &numLeaves, &cap);
+
+	s->numBatches = (numLeaves + SEARCH_BATCH_LEAVES - 1) / SEARCH_BATCH_LEAVES;
+	s->batches = malloc(sizeof(struct searchBatch) * (s->numBatches ? s->numBatches : 1));
+	long first = 0;
+	for(int i = 0; i < s->numBatches; ++i) {
+		struct searchBatch* b = &s->batches[i];
+		b->leaves = &s->leaves[i * SEARCH_BATCH_LEAVES];
+		b->numLeaves = numLeaves - i * SEARCH_BATCH_LEAVES < SEARCH_BATCH_LEAVES ?
+			numLeaves - i * SEARCH_BATCH_LEAVES : SEARCH_BATCH_LEAVES;
+		b->firstRow = first;
+		b->matches = NULL;
+		b->numMatches = 0;
+		b->cap = 0;
+		b->done = 0;
+		for(int j = 0; j < b->numLeaves; ++j) first += b->leaves[j]->numRows;
+	}
+	s->merged = 0;
+	s->nextBatch = 0;
+	s->cancel = 0;
+	s->numThreads = 0;
+
+	if(s->numBatches <= 1) {
+		if(s->numBatches) {
+			struct regexMatcher* rm = s->re ? regexMatcherNew(s->re) : NULL;
+			searchRunBatch(s, rm, &s->batches[0]);
+			regexMatcherFree(rm);
+		}
+		searchMerge(s);
+		if(s->batches) searchCancel(s);
+		return;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = s->numBatches < cpus ? s->numBatches : cpus;
+	if(threads > INDEX_THREADS_MAX) threads = INDEX_THREADS_MAX;
+	if(threads < 1) threads = 1;
+	for(int t = 0; t < threads; ++t) {
+		if(pthread_create(&s->threads[s->numThreads], NULL, searchWorker, s) == 0) s->numThreads++;
+	}
+	if(s->numThreads == 0) {
+		searchWorker(s);
+		searchMerge(s);
+	}
+}
 
-	// Allow Read/Write and Creating. Default permission apply (0644)
-	int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-	if(fd != -1) {
-		 if(ftruncate(fd, len) != -1) {
-			if(write(fd, buf, len) == len) {
-				close(fd);
-				free(buf);
-				editorSetStatusMessage("%d bytes saved to %s", len, E.filename);
-				E.dirty = 0;
-				return;
-			}
+/* Lets the scan in flight run to completion and merges all of it */
+void searchFinish(struct searchState* s) {
+	for(int t = 0; t < s->numThreads; ++t) pthread_join(s->threads[t], NULL);
+	s->numThreads = 0;
+	searchMerge(s);
+}
+
+/* Index of the first match at or after the given position */
+size_t searchFind(struct searchState* s, long row, long col) {
+	size_t lo = 0, hi = s->numMatches;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct searchMatch m = s->matches[mid];
+		if(m.row < row || (m.row == row && m.col < col)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Keeps the matches under node that still match the grown query, reading the
+ * text in place; subtrees without matches are skipped */
+void searchNarrowNode(struct searchState* s, rowNode* node, long first, size_t* next, size_t* kept) {
+	if(*next == s->numMatches || s->matches[*next].row >= first + node->numRows) return;
+	if(!node->isLeaf) {
+		for(int i = 0; i < node->count; ++i) {
+			searchNarrowNode(s, node->children[i], first, next, kept);
+			first += node->children[i]->numRows;
+		}
+		return;
+	}
+	size_t lines[ROW_LEAF_MAX + 1];
+	if(node->mapped) rowMapLines(node->mapOff, node->count, lines);
+	for(; *next < s->numMatches && s->matches[*next].row < first + node->numRows; ++*next) {
+		struct searchMatch m = s->matches[*next];
+		const char* text;
+		size_t size;
+		if(node->mapped) {
+			// The query holds no line breaks, so a match can't run into the next line
+			text = &E.map[lines[m.row - first]];
+			size = E.map + E.mapLen - text;
+		} else {
+			text = node->rows[m.row - first].chars;
+			size = node->rows[m.row - first].size;
+		}
+		if(m.col + s->len <= size && !memcmp(&text[m.col], s->query, s->len)) {
+			m.len = s->len;
+			s->matches[(*kept)++] = m;
 		}
-		close(fd);
 	}
-	free(buf);
-	editorSetStatusMessage("Couldn't save; I/O error: %s", strerror(errno));
+}
+
+/* Plain matches may overlap, so a query that only grew can only match where
+ * the shorter one did; those matches are filtered instead of rescanning.
+ * A regex is recompiled and rescanned on every change */
+void searchUpdate(struct searchState* s, const char* query) {
+	int len = strlen(query);
+	int narrow = !s->regex && s->query && s->len > 0 && s->batches == NULL &&
+		len >= s->len && !strncmp(query, s->query, s->len);
+	searchCancel(s);
+	free(s->query);
+	regexFree(s->re);
+	s->query = strdup(query);
+	s->len = len;
+	s->re = s->regex && len ? regexCompile(query) : NULL;
+	s->current = 0;
+	s->shown = 0;
+
+	if(len == 0 || (s->regex && s->re == NULL)) {
+		s->numMatches = 0;
+	} else if(narrow) {
+		size_t next = 0, kept = 0;
+		searchNarrowNode(s, E.rowRoot, 0, &next, &kept);
+		s->numMatches = kept;
+	} else {
+		s->numMatches = 0;
+		searchStart(s);
+	}
+}
+
+void searchReset(struct searchState* s) {
+	searchCancel(s);
+	s->hlRow = -1;
+	free(s->query);
+	free(s->matches);
+	regexFree(s->re);
+	s->query = NULL;
+	s->len = 0;
+	s->re = NULL;
+	s->matches = NULL;
+	s->numMatches = 0;
+	s->cap = 0;
+	s->current = 0;
 }
 
 /* Find */
 
-void editorFindCallback(char* query, int key) {
-	static int lastMatch = -1;
-	static int direction = 1;
+/* Moves to the current match and highlights it until the next key. The
+ * highlight is drawn over the row's spans rather than stored in them */
+void editorFindShow() {
+	struct searchState* s = &E.search;
+	struct searchMatch m = s->matches[s->current];
+	erow* row = editorRowAt(m.row);
+	E.cy = m.row;
+	E.cx = m.col;
+	E.rowOff = E.numRows;
+
+	s->hlRow = m.row;
+	s->hlFrom = editorCxToRx(row, m.col);
+	s->hlTo = editorCxToRx(row, m.col + m.len);
+	s->shown = 1;
+}
 
-	static int savedHlLine;
-	static char* savedHl = NULL;
+/* Called when scan workers finish batches; jumps to the first match as soon
+ * as it is known while the rest of the index fills in */
+void editorFindProgress() {
+	char drain[64];
+	while(read(E.searchWake[0], drain, sizeof(drain)) > 0);
+	struct searchState* s = &E.search;
+	searchMerge(s);
+	if(s->query && !s->shown && s->numMatches) editorFindShow();
+}
 
-	if(savedHl) {
-		memcpy(E.row[savedHlLine].hl, savedHl, E.row[savedHlLine].rsize);
-		free(savedHl);
-		savedHl = NULL;
-	}
+void editorFindCallback(char* query, int key) {
+	struct searchState* s = &E.search;
+	s->hlRow = -1;
 
 	if(key == '\r' || key == '\x1b') {
-		lastMatch = -1;
-		direction = 1;
+		searchReset(s);
 		return;
+	} else if(key == CTRL_KEY('r')) {
+		s->regex = !s->regex;
+		searchUpdate(s, query);
 	} else if(key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
+		// Next and previous are looked up from the cursor; they only wrap
+		// around once the index is complete
+		size_t i = s->shown ? searchFind(s, E.cy, E.cx + 1) : 0;
+		if(i == s->numMatches && s->batches == NULL) i = 0;
+		if(i < s->numMatches) s->current = i;
 	} else if(key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
+		size_t i = searchFind(s, E.cy, E.cx);
+		if(i > 0) s->current = i - 1;
+		else if(s->batches == NULL && s->numMatches) s->current = s->numMatches - 1;
 	} else {
-		lastMatch = -1;
-		direction = 1;
-	}
-
-	if(lastMatch == -1) direction = 1;
-	int current = lastMatch;
-
-	for(int i = 0; i < E.numRows; ++i) {
-		current += direction;
-		if(current == -1) current = E.numRows - 1;
-		else if(current == E.numRows) current = 0;
-
-		erow* row = &E.row[current];
-		char* match = strstr(row->render, query);
-		if(match) {
-			lastMatch = current;
-			E.cy = current;
-			E.cx = editorRxToCx(row, match - row->render);
-			E.rowOff = E.numRows;
-
-			savedHlLine = current;
-			savedHl = malloc(row->rsize * sizeof(char));
-			memcpy(savedHl, row->render, row->rsize);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
-		}
+		searchUpdate(s, query);
 	}
+	if(s->numMatches) editorFindShow();
 }
 
 void editorFind() {
-	int savedCx = E.cx;
-	int savedCy = E.cy;
-	int savedColOff = E.colOff;
-	int savedRowOff = E.rowOff;
+	long savedCx = E.cx;
+	long savedCy = E.cy;
+	long savedColOff = E.colOff;
+	long savedRowOff = E.rowOff;
 
-	char* query = editorPrompt("Search: %s (ESC to cancel)", editorFindCallback);
+	char* query = editorPrompt("Search: %s (ESC to cancel, Ctrl-R regex)", editorFindCallback);
 	if(query) {
 		free(query);
 	} else {
@@ -680,31 +4005,127 @@ void editorFind() {
 	}
 }
 
-/* append buffer */
+/* Replaces every match in one pass. Each affected row's text is rebuilt once
+ * and left stale, so rendering and comment state propagation happen in a
+ * single walk when the rows are next shown. Plain matches may overlap; a
+ * match starting inside the previous replaced one is skipped */
+void editorReplaceAll(const char* query, const char* with) {
+	struct searchState* s = &E.search;
+	searchUpdate(s, query);
+	searchFinish(s);
+	if(s->regex && s->re == NULL) {
+		searchReset(s);
+		editorSetStatusMessage("Bad pattern: %s", query);
+		return;
+	}
+
+	size_t withLen = strlen(with);
+	size_t count = 0;
+	long rows = 0;
+	size_t i = 0;
+	while(i < s->numMatches) {
+		long at = s->matches[i].row;
+		erow* row = editorRowAt(at);
+		size_t end = i;
+		size_t size = row->size;
+		for(long from = 0; end < s->numMatches && s->matches[end].row == at; ++end) {
+			struct searchMatch m = s->matches[end];
+			if(m.col < from) continue;
+			size += withLen - m.len;
+			from = m.col + m.len;
+		}
 
-#define ABUF_INIT {NULL, 0}
+		long cap;
+		char* chars = rowMemAlloc(MEM_CHARS, size + 1, &cap);
+		size_t len = 0;
+		long from = 0;
+		for(; i < end; ++i) {
+			struct searchMatch m = s->matches[i];
+			if(m.col < from) continue;
+			memcpy(&chars[len], &row->chars[from], m.col - from);
+			len += m.col - from;
+			memcpy(&chars[len], with, withLen);
+			len += withLen;
+			from = m.col + m.len;
+			count++;
+		}
+		memcpy(&chars[len], &row->chars[from], row->size - from);
+		chars[size] = '\0';
+		editorRowReplace(row, at, chars, size, cap);
+		rows++;
+	}
+	searchReset(s);
 
-struct abuf {
-	char* b;
-	int len;
-};
+	if(E.cy < E.numRows && E.cx > editorRowAt(E.cy)->size) E.cx = editorRowAt(E.cy)->size;
+	if(count) editorSetStatusMessage("Replaced %zu occurrences on %ld lines", count, rows);
+	else editorSetStatusMessage("No match for %s", query);
+}
+
+void editorReplace() {
+	long savedCx = E.cx;
+	long savedCy = E.cy;
+	long savedColOff = E.colOff;
+	long savedRowOff = E.rowOff;
+
+	char* query = editorPrompt("Replace: %s (ESC to cancel, Ctrl-R regex)", editorFindCallback);
+	E.cx = savedCx;
+	E.cy = savedCy;
+	E.colOff = savedColOff;
+	E.rowOff = savedRowOff;
+	if(query == NULL) return;
+
+	char* with = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+	if(with) {
+		editorReplaceAll(query, with);
+		free(with);
+	}
+	free(query);
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-	char *new = realloc(ab->b, ab->len + len);
+/* frame arena */
+
+/* Makes room for `len` more bytes, doubling the capacity as needed */
+char* arenaReserve(struct frameArena* a, int len) {
+	if(a->len + len > a->cap) {
+		int cap = a->cap ? a->cap : 4096;
+		while(cap < a->len + len) cap *= 2;
+		char* b = realloc(a->b, cap);
+		if(b == NULL) die("realloc");
+		a->b = b;
+		a->cap = cap;
+	}
+	return &a->b[a->len];
+}
 
-	if (new == NULL) return;
-	memcpy(&new[ab->len], s, len);
-	ab->b = new;
-	ab->len += len;
+void arenaAppend(struct frameArena* a, const char* s, int len) {
+	memcpy(arenaReserve(a, len), s, len);
+	a->len += len;
 }
 
-void abFree(struct abuf *ab) {
-	free(ab->b);
+void arenaAppendNum(struct frameArena* a, int n) {
+	char digits[12];
+	int len = 0;
+	do {
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	} while(n);
+	char* p = arenaReserve(a, len);
+	for(int i = 0; i < len; ++i) p[i] = digits[len - 1 - i];
+	a->len += len;
 }
 
 /* Input */
 
+/* Runs a prompt's callback, timed as the edit its key made */
+void editorPromptCallback(void (*callback)(char *, int), char* buf, int key) {
+	if(callback == NULL) return;
+	long long start = statNow();
+	callback(buf, key);
+	statAdd(STAT_EDIT, statNow() - start);
+}
+
 char* editorPrompt(char* prompt, void (*callback)(char *, int)) {
+	E.stats.prompted = 1;
 	size_t bufSize = 128;
 	char* buf = malloc(bufSize * sizeof(char));
 
@@ -713,12 +4134,26 @@ char* editorPrompt(char* prompt, void (*callback)(char *, int)) {
 
 	while(1) {
 		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
+		if(inputPending()) editorScroll();
+		else editorRefreshScreen();
 
 		int key = editorReadKey();
-		if(key == '\x1b') {
+		if(key == PASTE_START) {
+			size_t len;
+			char* text = editorReadPaste(&len);
+			for(size_t i = 0; i < len; ++i) {
+				if(iscntrl(text[i]) || (unsigned char)text[i] >= 128) continue;
+				if(bufLen == bufSize - 1) {
+					bufSize *= 2;
+					buf = realloc(buf, bufSize * sizeof(char));
+				}
+				buf[bufLen++] = text[i];
+			}
+			buf[bufLen] = '\0';
+			free(text);
+		} else if(key == '\x1b') {
 			editorSetStatusMessage("");
-			if(callback) callback(buf, key);
+			editorPromptCallback(callback, buf, key);
 			free(buf);
 			return NULL;
 		} else if(key == DEL_KEY || key == CTRL_KEY('h') || key == BACKSPACE) {
@@ -726,7 +4161,7 @@ char* editorPrompt(char* prompt, void (*callback)(char *, int)) {
 		} else if(key == '\r') {
 			if(bufLen != 0) {
 				editorSetStatusMessage("");
-				if(callback) callback(buf, key);
+				editorPromptCallback(callback, buf, key);
 				return buf;
 			}
 		} else if(!iscntrl(key) && key < 128) {
@@ -737,29 +4172,29 @@ char* editorPrompt(char* prompt, void (*callback)(char *, int)) {
 			buf[bufLen++] = key;
 			buf[bufLen] = '\0';
 		}
-		if(callback) callback(buf, key);
+		editorPromptCallback(callback, buf, key);
 	}
 }
 
 void editorMoveCursor(int key) {
-	erow* row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
+	erow* row = editorRowAt(E.cy);
 
 	switch(key) {
 		case ARROW_UP:
 			if(E.cy != 0) E.cy--;
 			break;
 		case ARROW_LEFT:
-			if(E.cx != 0) E.cx--;
+			if(E.cx != 0) E.cx = row ? editorRowStep(row, E.cx, 0) : E.cx - 1;
 			else if(E.cy > 0) {
 				E.cy--;
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			}
 			break;
 		case ARROW_DOWN:
 			if(E.cy < E.numRows) E.cy++;
 			break;
 		case ARROW_RIGHT:
-			if(row && E.cx < row->size) E.cx++;
+			if(row && E.cx < row->size) E.cx = editorRowStep(row, E.cx, 1);
 			else if(row && E.cy < E.numRows) {
 				E.cy++;
 				E.cx = 0;
@@ -767,14 +4202,19 @@ void editorMoveCursor(int key) {
 			break;
 	}
 
-	row = (E.cy >= E.numRows) ? NULL : &E.row[E.cy];
-	int rowLen = row ? row->size : 0;
+	row = editorRowAt(E.cy);
+	long rowLen = row ? row->size : 0;
 	if(row && E.cx > rowLen) E.cx = rowLen;
+	// Moving up or down keeps the byte offset, which may land inside a code point
+	while(row && E.cx > 0 && E.cx < rowLen && (row->chars[E.cx] & 0xC0) == 0x80) E.cx--;
 }
 
 void editorProcessKeypress() {
 	static int quitTimes = QUIT_TIMES;
 	int key = editorReadKey();
+	// Keys that open a prompt are timed per prompt key instead
+	long long start = statNow();
+	E.stats.prompted = 0;
 
 	switch(key) {
 		case '\r':
@@ -793,7 +4233,7 @@ void editorProcessKeypress() {
 			break;
 		case END_KEY:
 			if(E.cy < E.numRows)
-				E.cx = E.row[E.cy].size;
+				E.cx = editorRowAt(E.cy)->size;
 			break;
 
 		case BACKSPACE:
@@ -819,7 +4259,20 @@ void editorProcessKeypress() {
 			break;
 
 		case CTRL_KEY('l'):
+			E.frameValid = 0;
+			break;
+
 		case '\x1b':
+		case PASTE_END:
+			break;
+
+		case PASTE_START:
+			{
+				size_t len;
+				char* text = editorReadPaste(&len);
+				editorInsertText(text, len);
+				free(text);
+			}
 			break;
 
 		case CTRL_KEY('s'):
@@ -830,28 +4283,53 @@ void editorProcessKeypress() {
 			editorFind();
 			break;
 
+		case CTRL_KEY('r'):
+			editorReplace();
+			break;
+
+		case CTRL_KEY('g'):
+			editorShowMemory();
+			break;
+
+		case CTRL_KEY('t'):
+			E.stats.overlay = !E.stats.overlay;
+			break;
+
 		case CTRL_KEY('q'):
 			if(E.dirty && quitTimes > 0) {
 				editorSetStatusMessage("There are unsaved changes. Press CTRL+Q %d more times to quit.", quitTimes--);
 				return;
 			}
+			editorSaveFinish();
 			write(STDOUT_FILENO, "\x1b[2J", 4);
 			write(STDOUT_FILENO, "\x1b[1;1H", 6);
 			exit(0);
 			break;
 
 		default:
-			editorInsertChar((char)key);
+			if(key == '\t' || !iscntrl((unsigned char)key)) {
+				// Take the rest of a typed or unbracketed pasted run in one insertion
+				char run[1024];
+				int len = 0;
+				run[len++] = key;
+				int next;
+				while(len < (int)sizeof(run) && (next = inputPeek()) != -1 &&
+						(next == '\t' || !iscntrl(next))) run[len++] = inputByte();
+				editorInsertText(run, len);
+			} else {
+				editorInsertChar((char)key);
+			}
 			break;
 	}
 	quitTimes = QUIT_TIMES;
+	if(!E.stats.prompted) statAdd(STAT_EDIT, statNow() - start);
 }
 
 /* output */
 
 void editorScroll() {
 	E.rx = 0;
-	if(E.cy < E.numRows) E.rx = editorCxToRx(&E.row[E.cy], E.cx);
+	if(E.cy < E.numRows) E.rx = editorCxToRx(editorRowAt(E.cy), E.cx);
 
 	if(E.cy < E.rowOff) E.rowOff = E.cy;
 	if(E.cy >= E.rowOff + E.scrRows) E.rowOff = E.cy - E.scrRows + 1;
@@ -859,10 +4337,119 @@ void editorScroll() {
 	if(E.rx >= E.colOff + E.scrCols) E.colOff = E.rx - E.scrCols + 1;
 }
 
-void editorDrawRows(struct abuf* ab) {
+/* Places one glyph in the frame being composed; a wide one that does not
+ * fit before the edge is left blank */
+void screenPutCell(int y, int x, unsigned int cp, int width, unsigned char style) {
+	int at = y * E.frameCols + x;
+	if(width == 2 && x + 1 >= E.frameCols) cp = ' ';
+	E.frame.chars[at] = cp;
+	E.frame.styles[at] = style;
+	if(width == 2 && x + 1 < E.frameCols) {
+		E.frame.chars[at + 1] = 0;
+		E.frame.styles[at + 1] = style;
+	}
+}
+
+/* Adds combining marks to the glyph at column x, as a cluster in extra */
+void screenCombine(int y, int x, const char* s, int len) {
+	struct screen* f = &E.frame;
+	int at = y * E.frameCols + x;
+	if(x > 0 && f->chars[at] == 0) --at;
+
+	char glyph[64];
+	int n;
+	unsigned int c = f->chars[at];
+	if(c & CELL_CLUSTER) {
+		n = (unsigned char)f->extra[c & ~CELL_CLUSTER];
+		memcpy(glyph, &f->extra[(c & ~CELL_CLUSTER) + 1], n);
+	} else {
+		n = utf8Encode(c, glyph);
+	}
+	if(n + len >= (int)sizeof(glyph)) return;
+	memcpy(&glyph[n], s, len);
+	n += len;
+
+	if(f->extraLen + n + 1 > f->extraCap) {
+		f->extraCap = f->extraCap ? f->extraCap * 2 : 1024;
+		f->extra = realloc(f->extra, f->extraCap);
+	}
+	f->extra[f->extraLen] = n;
+	memcpy(&f->extra[f->extraLen + 1], glyph, n);
+	f->chars[at] = CELL_CLUSTER | f->extraLen;
+	f->extraLen += n + 1;
+}
+
+/* Writes `len` bytes of UTF-8 text into the frame being composed from column
+ * x, clipped to the line */
+void screenPut(int y, int x, const char* s, int len, unsigned char style) {
+	int at = y * E.frameCols;
+	for(int i = 0; i < len && x < E.frameCols; ) {
+		unsigned int cp = (unsigned char)s[i];
+		if(cp < 0x80) {
+			E.frame.chars[at + x] = cp;
+			E.frame.styles[at + x++] = style;
+			++i;
+			continue;
+		}
+		int n = utf8Decode(s, len, i, &cp);
+		if(cp == UTF8_BAD) cp = 0xFFFD;
+		int width = utf8Width(cp);
+		if(width == 0) {
+			if(x > 0) screenCombine(y, x - 1, &s[i], n);
+		} else {
+			screenPutCell(y, x, cp, width, style);
+			x += width;
+		}
+		i += n;
+	}
+}
+
+/* Draws a row holding multibyte text one code point at a time, from the
+ * chunk before the left edge. A wide glyph cut by either edge is drawn blank
+ * and combining marks join the glyph to their left */
+void editorDrawRowUtf8(int y, erow* row, int matched) {
+	long matchFrom = matched ? E.search.hlFrom : -1;
+	long matchTo = matched ? E.search.hlTo : -1;
+	long b = 0, col = 0;
+	if(row->numChunks) {
+		struct rowChunk* ch = &row->chunks[editorRowChunkAt(row, E.colOff, 1)];
+		b = ch->rx;
+		col = ch->col;
+	}
+	const char* text = row->render;
+	struct hlSpan* span = row->spans;
+	if(b < row->rsize) span += editorRowSpanAt(row, b);
+	while(b < row->rsize) {
+		long x = col - E.colOff;
+		if(x >= E.scrCols) break;
+		unsigned int cp = (unsigned char)text[b];
+		int len = 1;
+		if(cp >= 0x80) len = utf8Decode(text, row->rsize, b, &cp);
+		int width = utf8Width(cp);
+		while(span->start + span->len <= b) ++span;
+		int hl = col >= matchFrom && col < matchTo ? HL_MATCH : span->hl;
+		int colour = hl == HL_NORMAL ? STYLE_DEFAULT : editorSyntaxToColour(hl);
+
+		if(width == 0) {
+			if(x > 0) screenCombine(y, x - 1, &text[b], len);
+		} else if(x < 0 || x + width > E.scrCols) {
+			for(long i = x < 0 ? 0 : x; i < x + width && i < E.scrCols; ++i) screenPutCell(y, i, ' ', 1, colour);
+		} else if(cp < 0x20 || cp == 0x7F || (cp >= 0x80 && cp < 0xA0) || cp == UTF8_BAD) {
+			screenPutCell(y, x, cp <= 26 ? '@' + cp : '?', 1, colour | STYLE_INVERSE);
+		} else {
+			screenPutCell(y, x, cp, width, colour);
+		}
+		b += len;
+		col += width;
+	}
+}
+
+void editorDrawRows() {
 	int rows = E.scrRows;
+	editorSyntaxCatchUp(E.rowOff + rows - 1);
+	erow* row = editorRowAt(E.rowOff);
 	for(int y = 0; y < rows; ++y) {
-		int filerow = y + E.rowOff;
+		long filerow = y + E.rowOff;
 		if(filerow >= E.numRows) {
 			if (E.numRows == 0 && y == E.scrRows / 3) {
 			    char welcome[80];
@@ -870,113 +4457,319 @@ void editorDrawRows(struct abuf* ab) {
 			        "MTTE -- version %s", VERSION);
 			if (welcomelen > E.scrCols) welcomelen = E.scrCols;
 				int padding = (E.scrCols - welcomelen) / 2;
-				if (padding) {
-					abAppend(ab, "~", 1);
-					padding--;
-				}
-				while (padding--) abAppend(ab, " ", 1);
-			    abAppend(ab, welcome, welcomelen);
+				if (padding) screenPut(y, 0, "~", 1, STYLE_DEFAULT);
+			    screenPut(y, padding, welcome, welcomelen, STYLE_DEFAULT);
 			} else {
-			    abAppend(ab, "~", 1);
+			    screenPut(y, 0, "~", 1, STYLE_DEFAULT);
 			}
 		} else {
-			int len = E.row[filerow].rsize - E.colOff;
+			editorRowRender(row);
+			if(!(row->flags & ROW_ASCII)) {
+				editorDrawRowUtf8(y, row, filerow == E.search.hlRow);
+				row = editorRowNext(row);
+				continue;
+			}
+			long len = row->rsize - E.colOff;
 			if(len < 0) len = 0;
 			if (len > E.scrCols) len = E.scrCols;
-			char* c = &E.row[filerow].render[E.colOff];
-			unsigned char* hl = &E.row[filerow].hl[E.colOff];
-			int curColour = -1;
-			for(int j = 0; j < len; ++j) {
-				if(iscntrl(c[j])) {
-					char sym = c[j] <= 26 ? '@' + c[j] : '?';
-					abAppend(ab, "\x1b[7m", 4);
-					abAppend(ab, &sym, 1);
-					abAppend(ab, "\x1b[m", 3);
-					if(curColour != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", curColour);
-						abAppend(ab, buf, clen);
-					}
+			char* c = &row->render[E.colOff];
+			long matchFrom = -1, matchTo = -1;
+			if(filerow == E.search.hlRow) {
+				matchFrom = E.search.hlFrom - E.colOff;
+				matchTo = E.search.hlTo - E.colOff;
+			}
+			// One colour per span, split where the find match is drawn over it
+			struct hlSpan* span = row->spans;
+			if(len > 0) span += editorRowSpanAt(row, E.colOff);
+			int curColour = STYLE_DEFAULT;
+			int j = 0;
+			while(j < len) {
+				while(span->start + span->len - E.colOff <= j) ++span;
+				long end = span->start + span->len - E.colOff;
+				int hl = span->hl;
+				if(j >= matchFrom && j < matchTo) {
+					hl = HL_MATCH;
+					if(end > matchTo) end = matchTo;
+				} else if(j < matchFrom && end > matchFrom) {
+					end = matchFrom;
 				}
-				if(hl[j] == HL_NORMAL) {
-					if(curColour != -1) {
-						abAppend(ab, "\x1b[39m", 5);
-						curColour = -1;
-					}
-					abAppend(ab, &c[j], 1);
-				} else {
-					int colour = editorSyntaxToColour(hl[j]);
-					if(colour != curColour) {
-						curColour = colour;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", colour);
-						abAppend(ab, buf, clen);
+				if(end > len) end = len;
+				int colour = hl == HL_NORMAL ? STYLE_DEFAULT : editorSyntaxToColour(hl);
+				while(j < end) {
+					if(iscntrl(c[j])) {
+						char sym = c[j] <= 26 ? '@' + c[j] : '?';
+						screenPut(y, j++, &sym, 1, curColour | STYLE_INVERSE);
+						continue;
 					}
-					abAppend(ab, &c[j], 1);
+					int run = j + 1;
+					while(run < end && !iscntrl(c[run])) ++run;
+					curColour = colour;
+					screenPut(y, j, &c[j], run - j, curColour);
+					j = run;
 				}
 			}
-			abAppend(ab, "\x1b[39m", 5);
+			row = editorRowNext(row);
 		}
-
-		abAppend(ab, "\x1b[K", 3);
-		abAppend(ab, "\r\n", 2);
 	}
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-	abAppend(ab, "\x1b[7m", 4);
-
-	char lstatus[80], rstatus[80];
+void editorDrawStatusBar() {
+	int y = E.scrRows;
+	char lstatus[80], rstatus[128];
 	int llen = snprintf(lstatus, sizeof(lstatus), "> %.20s%s",
 		E.filename ? E.filename : "[No Name]",
 		E.dirty ? " (Modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | [%d/%d]", 
-		E.syntax ? E.syntax->filetype : "No FT", E.cy+1, E.numRows);
+	int rlen;
+	// Key-to-screen latency over the last STATS_WINDOW frames, toggled with Ctrl-T
+	char lat[64] = "";
+	if(E.stats.overlay) {
+		struct statHist* h = &E.stats.hist[STAT_LATENCY];
+		unsigned long long n = h->count < STATS_WINDOW ? h->count : STATS_WINDOW;
+		char p50[24], p99[24];
+		statFormatNs(p50, sizeof(p50), statPercentile(h->recent, n, 50));
+		statFormatNs(p99, sizeof(p99), statPercentile(h->recent, n, 99));
+		snprintf(lat, sizeof(lat), "p50 %s p99 %s | ", p50, p99);
+	}
+	const char* mode = E.search.regex ? "regex " : "";
+	if(E.search.query && E.search.numMatches)
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s%smatch %zu/%zu%s | %s | [%ld/%ld]",
+			lat, mode, E.search.current + 1, E.search.numMatches, E.search.batches ? "+" : "",
+			E.syntax ? E.syntax->filetype : "No FT", E.cy+1, E.numRows);
+	else if(E.search.query && E.search.len)
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%s | %s | [%ld/%ld]", lat, mode,
+			E.search.regex && E.search.re == NULL ? "bad pattern" :
+			E.search.batches ? "searching" : "no match",
+			E.syntax ? E.syntax->filetype : "No FT", E.cy+1, E.numRows);
+	else
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | [%ld/%ld]", lat,
+			E.syntax ? E.syntax->filetype : "No FT", E.cy+1, E.numRows);
 	if(llen > E.scrCols) llen = E.scrCols;
-	abAppend(ab, lstatus, llen);
 
-	while(llen < E.scrCols) {
-		if(E.scrCols - llen == rlen) {
-			abAppend(ab, rstatus, rlen);
-			break;
-		} else {
-			abAppend(ab, " ", 1);
-			llen++;
-		}
-	}
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
+	memset(&E.frame.styles[y * E.frameCols], STYLE_DEFAULT | STYLE_INVERSE, E.frameCols);
+	screenPut(y, 0, lstatus, llen, STYLE_DEFAULT | STYLE_INVERSE);
+	if(E.scrCols - llen >= rlen)
+		screenPut(y, E.scrCols - rlen, rstatus, rlen, STYLE_DEFAULT | STYLE_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf* ab) {
-	abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
 	int msgLen = strlen(E.statusmsg);
 	if(msgLen > E.scrCols) msgLen = E.scrCols;
-	if(msgLen && time(NULL) - E.statusmsg_time < 5) {
-		abAppend(ab, E.statusmsg, msgLen);
+	if(msgLen && time(NULL) - E.statusmsg_time < STATUS_TIMEOUT) {
+		screenPut(E.scrRows + 1, 0, E.statusmsg, msgLen, STYLE_DEFAULT);
 	}
 }
 
-void editorRefreshScreen() {
-	editorScroll();
+/* SGR sequences for every style, switching everything or just the colour */
+struct styleEscape {
+	char seq[12];
+	int len;
+};
 
-	struct abuf ab = ABUF_INIT;
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[1;1H", 6);
+struct styleEscape styleFull[256];
+struct styleEscape styleColour[256];
 
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
+void screenInitStyles() {
+	for(int style = 0; style < 256; ++style) {
+		int fg = style & ~STYLE_INVERSE;
+		styleFull[style].len = snprintf(styleFull[style].seq, sizeof(styleFull[style].seq),
+			"\x1b[%d;%dm", (style & STYLE_INVERSE) ? 7 : 27, fg);
+		styleColour[style].len = snprintf(styleColour[style].seq, sizeof(styleColour[style].seq),
+			"\x1b[%dm", fg);
+	}
+}
 
-	abAppend(&ab, "\x1b[H", 3);
+void screenSetStyle(struct frameArena* out, int* cur, unsigned char style) {
+	if(*cur == style) return;
+	struct styleEscape* esc = (*cur != -1 && ((*cur ^ style) & STYLE_INVERSE) == 0)
+		? &styleColour[style] : &styleFull[style];
+	arenaAppend(out, esc->seq, esc->len);
+	*cur = style;
+}
 
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowOff) + 1, (E.rx - E.colOff) + 1);
-	abAppend(&ab, buf, strlen(buf));
+void screenMoveTo(struct frameArena* out, int y, int x) {
+	arenaAppend(out, "\x1b[", 2);
+	arenaAppendNum(out, y + 1);
+	arenaAppend(out, ";", 1);
+	arenaAppendNum(out, x + 1);
+	arenaAppend(out, "H", 1);
+}
+
+void screenAlloc(struct screen* s, int cells) {
+	s->chars = realloc(s->chars, sizeof(unsigned int) * cells);
+	s->styles = realloc(s->styles, cells);
+}
+
+void screenBlank(struct screen* s, int at, int cells) {
+	for(int i = at; i < at + cells; ++i) s->chars[i] = ' ';
+	memset(&s->styles[at], STYLE_DEFAULT, cells);
+}
+
+int screenCellBlank(struct screen* s, int at) {
+	return s->chars[at] == ' ' && s->styles[at] == STYLE_DEFAULT;
+}
+
+/* Clusters are compared by their text, since each frame stores its own */
+int screenCellEqual(int at) {
+	unsigned int a = E.frame.chars[at], b = E.shown.chars[at];
+	if(E.frame.styles[at] != E.shown.styles[at]) return 0;
+	if(!(a & b & CELL_CLUSTER)) return a == b;
+	const char* ca = &E.frame.extra[a & ~CELL_CLUSTER];
+	const char* cb = &E.shown.extra[b & ~CELL_CLUSTER];
+	return ca[0] == cb[0] && !memcmp(ca + 1, cb + 1, (unsigned char)ca[0]);
+}
+
+/* Cluster cells hold offsets into each frame's own extra text, so equal
+ * offsets only mean equal glyphs once the text has been compared too */
+int screenLineEqual(int line, int cols) {
+	if(memcmp(&E.frame.chars[line], &E.shown.chars[line], sizeof(unsigned int) * cols) ||
+			memcmp(&E.frame.styles[line], &E.shown.styles[line], cols)) return 0;
+	for(int x = line; x < line + cols; ++x)
+		if((E.frame.chars[x] & CELL_CLUSTER) && !screenCellEqual(x)) return 0;
+	return 1;
+}
+
+/* Appends cells as UTF-8; the cell right of a wide glyph adds nothing */
+void screenAppendCells(struct frameArena* out, struct screen* s, int at, int n) {
+	for(int i = at; i < at + n; ++i) {
+		unsigned int c = s->chars[i];
+		if(c < 0x80 && c) {
+			*arenaReserve(out, 1) = c;
+			out->len++;
+		} else if(c & CELL_CLUSTER) {
+			const char* glyph = &s->extra[c & ~CELL_CLUSTER];
+			arenaAppend(out, glyph + 1, (unsigned char)glyph[0]);
+		} else if(c) {
+			out->len += utf8Encode(c, arenaReserve(out, 4));
+		}
+	}
+}
+
+/* When the view moved vertically by less than a screen, lets the terminal
+ * scroll the text area (DECSTBM region plus SU/SD) and shifts the retained
+ * frame the same way, so only the newly exposed lines are left to draw */
+void editorScrollFrame(struct frameArena* out) {
+	long delta = E.rowOff - E.shownRowOff;
+	if(!E.frameValid || delta == 0 || delta >= E.scrRows || -delta >= E.scrRows || E.colOff != E.shownColOff) return;
+	int lines = delta > 0 ? delta : -delta;
+
+	arenaAppend(out, "\x1b[m\x1b[1;", 7);
+	arenaAppendNum(out, E.scrRows);
+	arenaAppend(out, "r\x1b[", 3);
+	arenaAppendNum(out, lines);
+	arenaAppend(out, delta > 0 ? "S\x1b[r" : "T\x1b[r", 4);
+
+	int cols = E.frameCols;
+	int keep = (E.scrRows - lines) * cols;
+	if(delta > 0) {
+		memmove(E.shown.chars, &E.shown.chars[lines * cols], sizeof(unsigned int) * keep);
+		memmove(E.shown.styles, &E.shown.styles[lines * cols], keep);
+		screenBlank(&E.shown, keep, lines * cols);
+	} else {
+		memmove(&E.shown.chars[lines * cols], E.shown.chars, sizeof(unsigned int) * keep);
+		memmove(&E.shown.styles[lines * cols], E.shown.styles, keep);
+		screenBlank(&E.shown, 0, lines * cols);
+	}
+}
+
+/* Emits only the cells that differ from what the terminal already shows.
+ * Changed runs separated by a short unchanged gap are sent as one run, since
+ * rewriting a few cells is cheaper than another cursor move, and a blank line
+ * tail is cleared with a single erase */
+void editorFlushFrame(struct frameArena* out) {
+	editorScrollFrame(out);
+
+	int cols = E.frameCols;
+	int style = -1;
+	for(int y = 0; y < E.frameRows; ++y) {
+		int line = y * cols;
+		if(E.frameValid && screenLineEqual(line, cols)) continue;
+
+		int end = cols;
+		while(end > 0 && screenCellBlank(&E.frame, line + end - 1)) end--;
+
+		// Terminals do not all agree on the width of non-ASCII glyphs, so
+		// lines holding any are repainted whole rather than by position
+		int whole = !E.frameValid;
+		for(int x = 0; x < cols && !whole; ++x)
+			if(E.frame.chars[line + x] >= 0x80 || E.shown.chars[line + x] >= 0x80) whole = 1;
+
+		int x = 0;
+		while(x < end) {
+			if(!whole && screenCellEqual(line + x)) {
+				++x;
+				continue;
+			}
+			int runEnd = x + 1;
+			for(int gap = 0; runEnd + gap < end && gap < 8; ) {
+				if(whole || !screenCellEqual(line + runEnd + gap)) {
+					runEnd += gap + 1;
+					gap = 0;
+				} else {
+					++gap;
+				}
+			}
+			screenMoveTo(out, y, x);
+			while(x < runEnd) {
+				unsigned char runStyle = E.frame.styles[line + x];
+				int same = x + 1;
+				while(same < runEnd && E.frame.styles[line + same] == runStyle) ++same;
+				screenSetStyle(out, &style, runStyle);
+				screenAppendCells(out, &E.frame, line + x, same - x);
+				x = same;
+			}
+		}
+
+		int tailDirty = whole;
+		for(int i = end; i < cols && !tailDirty; ++i)
+			if(!screenCellBlank(&E.shown, line + i)) tailDirty = 1;
+		if(tailDirty && end < cols) {
+			screenMoveTo(out, y, end);
+			screenSetStyle(out, &style, STYLE_DEFAULT);
+			arenaAppend(out, "\x1b[K", 3);
+		}
+	}
+	if(style != -1 && style != STYLE_DEFAULT) arenaAppend(out, "\x1b[m", 3);
+
+	struct screen swap = E.shown;
+	E.shown = E.frame;
+	E.frame = swap;
+	E.frameValid = 1;
+	E.shownRowOff = E.rowOff;
+	E.shownColOff = E.colOff;
+}
+
+void editorRefreshScreen() {
+	editorScroll();
 
-	abAppend(&ab, "\x1b[?25h", 6);
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	int frameRows = E.scrRows + 2;
+	if(E.frameRows != frameRows || E.frameCols != E.scrCols) {
+		E.frameRows = frameRows;
+		E.frameCols = E.scrCols;
+		screenAlloc(&E.frame, frameRows * E.scrCols);
+		screenAlloc(&E.shown, frameRows * E.scrCols);
+		E.frameValid = 0;
+	}
+	screenBlank(&E.frame, 0, E.frameRows * E.frameCols);
+	E.frame.extraLen = 0;
+
+	long long start = statNow();
+	editorDrawRows();
+	statAdd(STAT_DRAW, statNow() - start);
+	editorDrawStatusBar();
+	editorDrawMessageBar();
+
+	struct frameArena* out = &E.out;
+	out->len = 0;
+	arenaAppend(out, "\x1b[?25l", 6);
+	editorFlushFrame(out);
+
+	screenMoveTo(out, E.cy - E.rowOff, E.rx - E.colOff);
+	arenaAppend(out, "\x1b[?25h", 6);
+	start = statNow();
+	if(E.headless) E.sinkBytes += out->len;
+	else write(STDOUT_FILENO, out->b, out->len);
+	statAdd(STAT_WRITE, statNow() - start);
+	statFrame(out->len);
 }
 
 void editorSetStatusMessage(const char* fmt, ...) {
@@ -987,6 +4780,138 @@ void editorSetStatusMessage(const char* fmt, ...) {
 	E.statusmsg_time = time(NULL);
 }
 
+/* Replay */
+
+/* Decodes the keys of a script line: \r \n \t \e \\ \xNN and \^ escapes, and
+ * ^X for Ctrl+X. Returns the number of bytes, or -1 on a bad escape */
+int replayDecode(const char* s, char* keys) {
+	int n = 0;
+	while(*s) {
+		char c = *s++;
+		if(c == '^' && *s) {
+			keys[n++] = CTRL_KEY(*s++);
+		} else if(c != '\\') {
+			keys[n++] = c;
+		} else {
+			c = *s++;
+			switch(c) {
+				case 'r': keys[n++] = '\r'; break;
+				case 'n': keys[n++] = '\n'; break;
+				case 't': keys[n++] = '\t'; break;
+				case 'e': keys[n++] = '\x1b'; break;
+				case '\\': keys[n++] = '\\'; break;
+				case '^': keys[n++] = '^'; break;
+				case 'x':
+					if(!isxdigit(s[0]) || !isxdigit(s[1])) return -1;
+					char hex[3] = { s[0], s[1], '\0' };
+					keys[n++] = (char)strtol(hex, NULL, 16);
+					s += 2;
+					break;
+				default: return -1;
+			}
+		}
+	}
+	return n;
+}
+
+/* Reads a script of "name repeat keys" lines; blank lines and lines
+ * starting with # are skipped */
+struct replayOp* replayLoad(const char* path, int* numOps) {
+	FILE* fp = fopen(path, "r");
+	if(!fp) die("fopen");
+	struct replayOp* ops = NULL;
+	int n = 0, cap = 0;
+	char* line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int lineno = 0;
+
+	while((linelen = getline(&line, &linecap, fp)) != -1) {
+		++lineno;
+		while(linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) line[--linelen] = '\0';
+		if(linelen == 0 || line[0] == '#') continue;
+
+		char name[32];
+		int repeat, at;
+		struct replayOp op;
+		op.keys = malloc(linelen + 1);
+		op.len = -1;
+		if(sscanf(line, "%31s %d %n", name, &repeat, &at) == 2 && repeat > 0)
+			op.len = replayDecode(&line[at], op.keys);
+		if(op.len <= 0 || op.len > INPUT_RING_SIZE) {
+			fprintf(stderr, "%s:%d: expected \"name repeat keys\"\n", path, lineno);
+			exit(1);
+		}
+		op.name = strdup(name);
+		op.repeat = repeat;
+		op.samples = malloc(sizeof(long long) * repeat);
+		op.outBytes = 0;
+		if(n == cap) {
+			cap = cap ? cap * 2 : 16;
+			ops = realloc(ops, sizeof(struct replayOp) * cap);
+		}
+		ops[n++] = op;
+	}
+	free(line);
+	fclose(fp);
+	*numOps = n;
+	return ops;
+}
+
+int replayCompare(const void* a, const void* b) {
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+/* Runs a script against the loaded buffer without a terminal. Each run of
+ * an op is timed like one turn of the event loop: its keys are processed
+ * and the frame is composed into the arena, which stands in for the
+ * terminal. Background saves and scans are reaped between runs, untimed */
+void editorReplay(const char* path) {
+	int numOps;
+	struct replayOp* ops = replayLoad(path, &numOps);
+
+	for(int i = 0; i < numOps; ++i) {
+		struct replayOp* op = &ops[i];
+		for(int r = 0; r < op->repeat; ++r) {
+			inputFeed(op->keys, op->len);
+			size_t sunk = E.sinkBytes;
+			long long start = statNow();
+			do {
+				editorProcessKeypress();
+				editorScroll();
+			} while(inputPending());
+			editorRefreshScreen();
+			editorPageOut();
+			op->samples[r] = statNow() - start;
+			hlSchedule(&E.hlJob);
+			op->outBytes += E.sinkBytes - sunk;
+
+			editorSaveFinish();
+			inputWait(0);
+		}
+	}
+
+	printf("%s: %ld rows, %dx%d screen\n", E.filename ? E.filename : "(empty)",
+		E.numRows, E.scrRows + 2, E.scrCols);
+	printf("%-12s %7s %10s %10s %10s %10s %10s\n", "op", "runs", "p50 us", "p90 us", "p99 us", "max us", "out B/run");
+	for(int i = 0; i < numOps; ++i) {
+		struct replayOp* op = &ops[i];
+		int n = op->repeat;
+		qsort(op->samples, n, sizeof(long long), replayCompare);
+		printf("%-12s %7d %10.1f %10.1f %10.1f %10.1f %10zu\n", op->name, n,
+			op->samples[(n - 1) * 50 / 100] / 1000.0,
+			op->samples[(n - 1) * 90 / 100] / 1000.0,
+			op->samples[(n - 1) * 99 / 100] / 1000.0,
+			op->samples[n - 1] / 1000.0,
+			op->outBytes / n);
+		free(op->name);
+		free(op->keys);
+		free(op->samples);
+	}
+	free(ops);
+}
+
 /* init */
 
 void initEditor() {
@@ -995,29 +4920,133 @@ void initEditor() {
 	E.numRows = 0;
 	E.rowOff = 0;
 	E.colOff = 0;
-	E.row = NULL;
+	rowMemInit();
+	E.rowRoot = rowNodeNew(1);
 	E.dirty = 0;
 	E.filename = NULL;
 	E.statusmsg[0] = '\0';
 	E.statusmsg_time = 0;
+	E.frame.chars = NULL;
+	E.frame.styles = NULL;
+	E.frame.extra = NULL;
+	E.frame.extraLen = 0;
+	E.frame.extraCap = 0;
+	E.shown.chars = NULL;
+	E.shown.styles = NULL;
+	E.shown.extra = NULL;
+	E.shown.extraLen = 0;
+	E.shown.extraCap = 0;
+	E.out.b = NULL;
+	E.out.len = 0;
+	E.out.cap = 0;
+	screenInitStyles();
+	E.frameRows = 0;
+	E.frameCols = 0;
+	E.frameValid = 0;
+	E.shownRowOff = 0;
+	E.shownColOff = 0;
 	E.syntax = NULL;
-
- 	if (getWindowSize(&E.scrRows, &E.scrCols) == -1) die("getWindowSize");
+	E.hlStaleFrom = -1;
+	E.hlStaleTo = -1;
+	E.hlJob.running = 0;
+	E.hlJob.tasks = NULL;
+	E.hlJob.numTasks = 0;
+	E.hlJob.pending = 0;
+	E.map = NULL;
+	E.mapLen = 0;
+	E.pages.leaves = NULL;
+	E.pages.count = 0;
+	E.pages.cap = 0;
+	E.pages.hand = 0;
+	E.pages.evicted = 0;
+	if(E.pages.budget == 0) E.pages.budget = (size_t)PAGE_BUDGET_MB << 20;
+	editorSyntaxCompile();
+
+	E.save = NULL;
+	E.saveGen = 0;
+	E.search.query = NULL;
+	E.search.len = 0;
+	E.search.regex = 0;
+	E.search.re = NULL;
+	E.search.matches = NULL;
+	E.search.numMatches = 0;
+	E.search.cap = 0;
+	E.search.current = 0;
+	E.search.hlRow = -1;
+	E.search.leaves = NULL;
+	E.search.batches = NULL;
+	E.search.numBatches = 0;
+	E.search.numThreads = 0;
+	E.search.cancel = 0;
+	if(pipe(E.searchWake) == -1) die("pipe");
+	fcntl(E.searchWake[0], F_SETFL, O_NONBLOCK);
+	fcntl(E.searchWake[1], F_SETFL, O_NONBLOCK);
+#ifdef __SSE2__
+	searchScan = searchScanSSE2;
+	asciiScan = asciiScanSSE2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+	if(__builtin_cpu_supports("avx2")) {
+		searchScan = searchScanAVX2;
+		asciiScan = asciiScanAVX2;
+	}
+#endif
+	if(pipe(E.saveDone) == -1) die("pipe");
+	fcntl(E.saveDone[0], F_SETFL, O_NONBLOCK);
+
+	if(pipe(E.winchPipe) == -1) die("pipe");
+	fcntl(E.winchPipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(E.winchPipe[1], F_SETFL, O_NONBLOCK);
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleWinch;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if(sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+
+ 	if(E.headless) {
+ 		E.scrRows = REPLAY_ROWS;
+ 		E.scrCols = REPLAY_COLS;
+ 	} else if (getWindowSize(&E.scrRows, &E.scrCols) == -1) die("getWindowSize");
  	E.scrRows -= 2;
 }
 
 int main(int argc, char *argv[]) {
-	enterRawMode();
+	// --replay SCRIPT runs a keystroke script headless and reports how long
+	// each op took; --stats-file PATH writes the stats as JSON on exit;
+	// --memory MIB sets the budget for rows loaded from the file
+	char* script = NULL;
+	int arg = 1;
+	for(; arg + 1 < argc; arg += 2) {
+		if(strcmp(argv[arg], "--replay") == 0) script = argv[arg+1];
+		else if(strcmp(argv[arg], "--stats-file") == 0) E.stats.file = argv[arg+1];
+		else if(strcmp(argv[arg], "--memory") == 0) E.pages.budget = (size_t)atol(argv[arg+1]) << 20;
+		else break;
+	}
+	if(script) E.headless = 1;
+	else enterRawMode();
+	if(E.stats.file) atexit(editorStatsWrite);
 	initEditor();
-	if(argc >= 2) {
-		editorOpen(argv[1]);
+	if(arg < argc) {
+		editorOpen(argv[arg]);
 	}
 
-	editorSetStatusMessage("HELP: Ctrl + Q = Quit | Ctrl + S = Save | Ctrl + F = Find");
+	editorSetStatusMessage("HELP: Ctrl + Q = Quit | Ctrl + S = Save | Ctrl + F = Find | Ctrl + R = Replace");
+	if(script) {
+		editorReplay(script);
+		return 0;
+	}
 
+	// Redraw once per batch of input rather than once per key, keeping the
+	// viewport current in between since paging depends on it
 	while(1) {
 		editorRefreshScreen();
-		editorProcessKeypress();
+		editorPageOut();
+		hlSchedule(&E.hlJob);
+		do {
+			editorProcessKeypress();
+			editorScroll();
+		} while(inputPending());
 	}
 
 	return 0;